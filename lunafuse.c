@@ -4,6 +4,7 @@ gcc -Wall lunafuse.c `pkg-config fuse --cflags --libs` -o lunafuse -lsqlite3 -L
 #define FUSE_USE_VERSION 26
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <string.h>
@@ -15,9 +16,35 @@ gcc -Wall lunafuse.c `pkg-config fuse --cflags --libs` -o lunafuse -lsqlite3 -L
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #define SHA1_LEN 40
 #define SHA1_MAX 1048576
+#define ASOF_INTERVAL 256     /* hist ids between two as-of checkpoints */
+#define ASOF_CHECKPOINTS 8    /* as-of checkpoints kept per box */
+#define ASOF_SPILL 4          /* every 4th checkpoint is also kept on disk */
+#define MMAP_CHUNKS 256       /* chunk objects kept mapped with -o mmap_chunks */
+#define CHUNK_INDEXES 64      /* chunk offset indexes kept for recently read files */
+#define CHUNKS_MAX 65536      /* longest chunk list of a file */
+#define URING_DEPTH 64        /* io_uring entries per thread with -o uring */
+#define BOXES_MAX 64          /* boxes mounted by one process with -b */
+#define TRACE_SLOTS 1024      /* records buffered per thread with -o trace */
+#define TRACE_RINGS 256       /* threads that can be traced at once */
+#define TRACE_MAGIC "LUNATRC1"
+#define WRITE_BATCH 64        /* changes per sqlite transaction with -o rw */
+#define WRITE_BATCH_MS 200    /* longest a change waits for its commit */
+#define WRITE_BUSY_MS 5000    /* wait for a sync client holding the db */
+#define WRITE_MAX ((size_t)CHUNKS_MAX * SHA1_MAX)  /* largest file a chunk list holds */
 
 static const char *usage =
 "usage: lunafuse [options]\n"
@@ -26,6 +53,18 @@ static const char *usage =
 "    --help|-h             print this help message\n"
 "    -m                    the path of db\n"
 "    -k                    the path of data\n"
+"    -b <name>=<db>        mount the box in db as directory name, repeatable\n"
+"    -b <kvs.db>           mount every box listed in kvs.db, box <id> being\n"
+"                          fs<id>.db next to it; -b replaces -m\n"
+"                          a name already mounted gets -<id> appended\n"
+"    -o mmap_chunks        serve chunk reads from memory mappings\n"
+"    -o uring              batch chunk reads with io_uring (unless mmap_chunks)\n"
+"    -o verify=first       check each chunk against its sha1 on first read\n"
+"    -o verify=always      check each chunk against its sha1 on every read\n"
+"    -o rw                 allow writing, new content is stored as chunk objects\n"
+"    -o trace=<file>       record getattr/readdir/open/read/release calls to file\n"
+"    -r <file>             replay a trace against -m/-k instead of mounting\n"
+"    -o replay_fast        replay without the recorded delays\n"
 "    to use the function,'-k' and '-m' are necessary."
 "\n";
 
@@ -59,12 +98,28 @@ typedef struct fs_head_t {
 #pragma pack(pop)
 
 static char name[100][512];
-static char sha1[401];
 static char data_path[512];
 static char time_f[100][20];
 static int num = 0;  
 static fs_head_t head[100][200];
-sqlite3 *db;
+static __thread sqlite3 *db;   /* box_cur->db */
+
+/*
+ * chunk lists are copied into a buffer the caller owns and frees, since
+ * fuse runs the lookups of many files at once. lists longer than
+ * CHUNKS_MAX chunks are refused, not truncated.
+ */
+static int setsha1(char **list, const char *s, size_t len){
+    if(s == NULL)
+        len = 0;
+    if(len > SHA1_LEN * CHUNKS_MAX)
+        return -EFBIG;
+    if((*list = (char*)malloc(len + 1)) == NULL)
+        return -ENOMEM;
+    memcpy(*list, s, len);
+    (*list)[len] = '\0';
+    return 0;
+}
 
 static void getname_head(const char *path){
     int rc, j = 0;
@@ -134,7 +189,7 @@ static char gettype_head(const char *path){
     char *sql;
     const char *tail;
     sqlite3_stmt *stmt;
-    char type;
+    char type = '\0';
 
     sql = sqlite3_mprintf(
         "SELECT type FROM head WHERE name=%Q AND status ='o'", path);
@@ -219,8 +274,8 @@ static int getctime_head(const char *path){
     return ctime;
 }
 
-static void getsha1_head(const char *path){
-    int rc;
+static int getsha1_head(const char *path, char **list){
+    int rc, res = 0;
     char *sql;
     const char *tail;
     sqlite3_stmt *stmt;
@@ -232,12 +287,14 @@ static void getsha1_head(const char *path){
         fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
     }
     
+    *list = NULL;
     rc = sqlite3_step(stmt);
     if(rc == SQLITE_ROW){
-        strcpy(sha1, (char*)sqlite3_column_text(stmt, 0));
+        res = setsha1(list, (const char*)sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
     }
 
     sqlite3_finalize(stmt);
+    return res;
 }
 
 //get the deleted file name
@@ -329,13 +386,12 @@ static void getname_hist(char *path){
     }
 }
 
-static int getmode_del(const char *path){
-    int rc, len;
+static int getid_del(const char *path){
+    int rc, id = 0, len;
     char *sql;
     char *p;
     const char *tail;
     sqlite3_stmt *stmt;
-    int mode;
     char s[512];
     char t[512];
 
@@ -348,117 +404,98 @@ static int getmode_del(const char *path){
     strcat(t, p);
 
     sql = sqlite3_mprintf(
-        "SELECT mode FROM hist WHERE name LIKE %Q OR name=%Q AND op ='d'", t, path);
+        "SELECT id FROM hist WHERE op='d' AND (name LIKE %Q OR name=%Q) ORDER BY id", t, path);
     rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
-    if(rc != SQLITE_OK){
-        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
-    }
-    
+    sqlite3_free(sql);
     rc = sqlite3_step(stmt);
-    while(rc == SQLITE_ROW){
-        mode = sqlite3_column_int(stmt, 0);
-        rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW){
+        id = sqlite3_column_int(stmt, 0);
     }   
 
     sqlite3_finalize(stmt);
-    return mode;
+    return id;
 }
 
-static int getsize_del(const char *path){
-    int rc, len;
+static int getmode_del(const char *path){
+    int rc;
     char *sql;
-    char *p;
     const char *tail;
     sqlite3_stmt *stmt;
-    int size;
-    char s[512];
-    char t[512];
+    int mode = 0;
 
-    strcpy(s, path);
-    p = strrchr(s, '/');
-    len = p - s;
-    strncpy(t, s, len);
-    t[len] = '\0';
-    strcat(t, "/%");
-    strcat(t, p);
-    
-    sql = sqlite3_mprintf(
-        "SELECT size FROM hist WHERE name LIKE %Q OR name=%Q AND op='d'", t, path);
+    sql = sqlite3_mprintf("SELECT mode FROM hist WHERE id=%d", getid_del(path));
     rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
     if(rc != SQLITE_OK){
         fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return 0;
     }
     
     rc = sqlite3_step(stmt);
-    while(rc == SQLITE_ROW){
-        size = sqlite3_column_int(stmt, 0);
-        rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW){
+        mode = sqlite3_column_int(stmt, 0);
     }   
 
     sqlite3_finalize(stmt);
-    return size;
+    return mode;
 }
 
-static int getid_del(const char *path){
-    int rc, id, len;
+static int getsize_del(const char *path){
+    int rc;
     char *sql;
-    char *p;
     const char *tail;
     sqlite3_stmt *stmt;
-    char s[512];
-    char t[512];
-
-    strcpy(s, path);
-    p = strrchr(s, '/');
-    len = p - s;
-    strncpy(t, s, len);
-    t[len] = '\0';
-    strcat(t, "/%");
-    strcat(t, p);
+    int size = 0;
 
-    sql = sqlite3_mprintf(
-        "SELECT id FROM hist WHERE op='d' AND name LIKE %Q OR name=%Q", t, path);
+    sql = sqlite3_mprintf("SELECT size FROM hist WHERE id=%d", getid_del(path));
     rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    
     rc = sqlite3_step(stmt);
     if(rc == SQLITE_ROW){
-        id = sqlite3_column_int(stmt, 0);
+        size = sqlite3_column_int(stmt, 0);
     }   
 
     sqlite3_finalize(stmt);
-    return id;
+    return size;
 }
 
-static void getsha1_del(const char *path){
-    int rc, id, len;
+//content of the version the delete row removed: the last change of
+//that exact name before it, never a later recreation
+static int getsha1_del(const char *path, char **list){
+    int rc, id, res = 0;
     char *sql;
-    char *p;
     const char *tail;
     sqlite3_stmt *stmt;
-    char s[512];
-    char t[512];
-    id = getid_del(path);
-
-    strcpy(s, path);
-    p = strrchr(s, '/');
-    len = p - s;
-    strncpy(t, s, len);
-    t[len] = '\0';
-    strcat(t, "/%");
-    strcat(t, p);
 
+    *list = NULL;
+    if((id = getid_del(path)) == 0)
+        return 0;
     sql = sqlite3_mprintf(
-        "SELECT sha1 FROM hist WHERE op!='d' AND id<%d AND name LIKE %Q OR name=%Q ", id, t, path);
+        "SELECT sha1 FROM hist WHERE op!='d' AND id<%d AND\
+        name=(SELECT name FROM hist WHERE id=%d) ORDER BY id DESC LIMIT 1", id, id);
     rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return -EIO;
+    }
+
     rc = sqlite3_step(stmt);
-    while(rc == SQLITE_ROW){
-        strcpy(sha1, (const char*)sqlite3_column_text(stmt, 0));
-        rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW){
+        res = setsha1(list, (const char*)sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
     }
 
     sqlite3_finalize(stmt);
+    return res;
 }
 
-static void getsha1_dir(const char *path){
+//the 'd' object of a .history snapshot dir, "" when there is none
+static void getsha1_dir(const char *path, char *id){
     int rc, n;
     char *sql, *p;
     const char *tail;
@@ -482,12 +519,11 @@ static void getsha1_dir(const char *path){
         fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
     }
     
+    id[0] = '\0';
     rc = sqlite3_step(stmt);
-    if(rc == SQLITE_ROW){
-        strcpy(sha1, (char*)sqlite3_column_text(stmt, 0));
-    }else {
-        sha1[0] = '\0';
-    }   
+    if(rc == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == SHA1_LEN){
+        memcpy(id, sqlite3_column_text(stmt, 0), SHA1_LEN + 1);
+    }
 
     sqlite3_finalize(stmt);
 }
@@ -563,248 +599,3470 @@ static void gettime_hist(const char *path){
     sqlite3_finalize(stmt);
 }
 
-static int lunafuse_getattr(const char *path, struct stat *stbuf)
-{
-	int res = 0, i = 0, j;
-    int len = strlen(path);
-    char *p, *q;
-    char tmp_path[512];
-    char tmp_name[512];
-    char sha1_path[512];
-	memset(stbuf, 0, sizeof(struct stat));
+/*
+ * point-in-time view under /.asof/<timestamp>/, rebuilt by replaying the
+ * a/m/d rows of hist. the namespace can be materialized every
+ * ASOF_INTERVAL hist ids; checkpoints are built lazily from the closest
+ * lower one and at most ASOF_CHECKPOINTS are kept, the least recently used
+ * going first, so a query only replays the rows from a nearby checkpoint.
+ * every ASOF_SPILL-th checkpoint a build passes is also written to an
+ * unlinked per-box file, so a rebuild never replays more than ASOF_SPILL
+ * intervals, whatever was evicted and however long the history is.
+ */
+typedef struct asof_entry_t {
+    char    *name;
+    char     type;
+    int      mode;
+    int64_t  size;
+    int64_t  histid;            /* hist row the entry comes from        */
+    char    *sha1;
+} asof_entry_t;
 
+typedef struct asof_view_t {
+    int64_t       histid;       /* last hist id applied to the view     */
+    int           num;
+    int           cap;
+    asof_entry_t *entry;        /* sorted by name                       */
+} asof_view_t;
 
-	if (strcmp(path, "/") == 0 ||
-        (len > 8 && strcmp(path + len -8, ".history") == 0)||
-        ((p = strstr(path, "/.history")) != NULL && *(p + 29) != '/')
-        || ((q = strstr(path, "/.deleted")) != NULL && *(q + 9) != '/')){ 
-		stbuf->st_mode = S_IFDIR | 493;
-		stbuf->st_nlink = 2;
-	} 
+/*
+ * a box is one fs*.db. with -b several boxes are mounted side by side as
+ * top-level directories, each with its own sqlite handle and as-of views;
+ * the object directory and every chunk cache are shared since they are
+ * keyed by sha1.
+ */
+typedef struct box_t {
+    char             name[64];      /* top-level dir, "" for a single box   */
+    sqlite3         *db;
+    asof_view_t    **asof_ckpt;     /* asof_ckpt[k]: view at id k*ASOF_INTERVAL */
+    uint64_t        *asof_ckpt_used;    /* tick of its last use         */
+    int64_t         *asof_ckpt_off;     /* offset in asof_spill, -1 if none */
+    FILE            *asof_spill;    /* checkpoints as 'd' objects           */
+    int              asof_ckpt_num;
+    int              asof_ckpt_live;    /* non-NULL entries, besides [0] */
+    uint64_t         asof_tick;
+    asof_view_t     *asof_cur;      /* view of the last query               */
+    pthread_mutex_t  asof_lock;
+    pthread_mutex_t  write_lock;    /* the open write transaction          */
+    int              txn_ops;       /* changes in it, 0 when none is open  */
+    uint64_t         txn_start;     /* ms it was opened at                 */
+    int              txn_err;       /* changes lost since the last flush   */
+    struct wfile_t  *wopen;         /* files open for writing              */
+    char             uuid[40];      /* boxid of new hist rows              */
+    int              uid;
+} box_t;
 
-    else if(strstr(path, "/.history/") != NULL){
-        strcpy(tmp_name, path);
-        getname_hist(tmp_name);
-        p = strrchr(path, '/');
-        j = p - path;
-        strncpy(tmp_path, path, j);
-        tmp_path[j] = '\0';
-        getsha1_dir(tmp_path);
-        strcpy(sha1_path, data_path);
-        strcat(sha1_path, sha1);
-        get_fs_head(sha1_path);
+static box_t box[BOXES_MAX];
+static int nbox = 0;
+static int box_multi = 0;
+static __thread box_t *box_cur;     /* box of the call being served */
 
-        while(i < num){
-            if(strcmp(tmp_name, fs_head_name(head[i])) == 0){
-                if(head[i]->type == 'd'){
-                    stbuf->st_mode = S_IFDIR | head[i]->mode;
-		            stbuf->st_nlink = 2;
-                }else{
-                    stbuf->st_mode = S_IFREG | head[i]->mode;
-		            stbuf->st_nlink = 1;
-                }
-                stbuf->st_size = head[i]->size; 
-                break;
-            }
-            i++;
-        }
+static asof_view_t *asof_view_new(void){
+    return (asof_view_t*)calloc(1, sizeof(asof_view_t));
+}
+
+static void asof_view_free(asof_view_t *v){
+    int i;
+
+    if(v == NULL)
+        return;
+    for(i = 0; i < v->num; i++){
+        free(v->entry[i].name);
+        free(v->entry[i].sha1);
     }
-    
-    else if(strstr(path, "/.deleted/") != NULL){
-        strcpy(tmp_path, path);
-        getname_hist(tmp_path);
-        stbuf->st_mode = S_IFREG | getmode_del(tmp_path);
-	    stbuf->st_nlink = 1;
-		stbuf->st_size = getsize_del(tmp_path);
+    free(v->entry);
+    free(v);
+}
+
+static asof_view_t *asof_view_copy(const asof_view_t *src){
+    int i;
+    asof_view_t *v = asof_view_new();
+
+    v->histid = src->histid;
+    v->num = v->cap = src->num;
+    if(v->cap > 0)
+        v->entry = (asof_entry_t*)malloc(v->cap * sizeof(asof_entry_t));
+    for(i = 0; i < src->num; i++){
+        v->entry[i] = src->entry[i];
+        v->entry[i].name = strdup(src->entry[i].name);
+        v->entry[i].sha1 = strdup(src->entry[i].sha1);
     }
+    return v;
+}
 
-	else {
-        if(gettype_head(path) == 'd'){
-		            stbuf->st_mode = S_IFDIR | getmode_head(path);
-		            stbuf->st_nlink = 2;
+//binary search, returns the insert position when name is absent
+static int asof_find(const asof_view_t *v, const char *name, int *found){
+    int lo = 0, hi = v->num, mid, c;
+
+    *found = 0;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        c = strcmp(v->entry[mid].name, name);
+        if(c == 0){
+            *found = 1;
+            return mid;
         }
-        else if(gettype_head(path) == 'f'){
-                    stbuf->st_mode = S_IFREG | getmode_head(path);
-		            stbuf->st_nlink = 1;
-            }
-            else res = -ENOENT;
-		stbuf->st_size = getsize_head(path);
-		//stbuf->st_mtime = getmtime_head(path);
-		//stbuf->st_ctime = getctime_head(path);
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-
-	return res;
+    return lo;
 }
 
-static int lunafuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	(void) offset;
-	(void) fi;
-    int i = 0, n, j, len;
-    char *p;
-    char *q;
-    char timename[20];
-    char tmp_path[512];
-    char sha1_path[512];
+static void asof_remove(asof_view_t *v, int i){
+    free(v->entry[i].name);
+    free(v->entry[i].sha1);
+    memmove(v->entry + i, v->entry + i + 1, (v->num - i - 1) * sizeof(asof_entry_t));
+    v->num--;
+}
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+static void asof_apply(asof_view_t *v, int64_t histid, char op, const char *name,
+        char type, int mode, int64_t size, const char *sha1_s){
+    int i, found, len;
 
-//under the history dir to filler the time dir
-    if(strcmp(p = strrchr(path, '/'), "/.history") == 0){
-        gettime_hist(path);
-        while(i < num){
-		    filler(buf, time_f[i], NULL, 0);
-            i++;
+    i = asof_find(v, name, &found);
+    if(op == 'd'){
+        if(found)
+            asof_remove(v, i);
+        //drop whatever is left below a deleted directory
+        len = strlen(name);
+        for(i = 0; i < v->num; ){
+            if(strncmp(v->entry[i].name, name, len) == 0 &&
+                    v->entry[i].name[len] == '/')
+                asof_remove(v, i);
+            else
+                i++;
         }
+        return;
     }
+    if(op != 'a' && op != 'm')
+        return;
 
-//under the time dir to filler the file
-    else if((q = strstr(path, "/.history/")) != NULL ){
-        getsha1_dir(path);
-        strcpy(sha1_path, data_path);
-        strcat(sha1_path, sha1);
-        get_fs_head(sha1_path);
-        if(strlen(sha1) == 0){
-            num = 0;
-        }
-        while(i < num){
-            p = strrchr(fs_head_name(head[i]), '/');
-            j = p - fs_head_name(head[i]) + 1;
-            filler(buf, fs_head_name(head[i]) + j, NULL, 0);
-            i++;
+    if(!found){
+        if(v->num == v->cap){
+            v->cap = v->cap ? v->cap * 2 : 64;
+            v->entry = (asof_entry_t*)realloc(v->entry, v->cap * sizeof(asof_entry_t));
         }
+        memmove(v->entry + i + 1, v->entry + i, (v->num - i) * sizeof(asof_entry_t));
+        v->entry[i].name = strdup(name);
+        v->entry[i].sha1 = NULL;
+        v->num++;
     }
+    free(v->entry[i].sha1);
+    v->entry[i].sha1 = strdup(sha1_s ? sha1_s : "");
+    v->entry[i].type = type;
+    v->entry[i].mode = mode;
+    v->entry[i].size = size;
+    v->entry[i].histid = histid;
+}
 
-//filler deleted file
-    else if((p = strstr(path, "/.deleted")) != NULL){
-            strcpy(tmp_path, path);
-            getname_hist(tmp_path);
-            getname_del(tmp_path); 
-            while(i < num){
-                filler(buf, name[i], NULL, 0);
-                i++;
-            }
-        }    
+//apply the hist rows in (v->histid, to]
+static void asof_replay(asof_view_t *v, int64_t to){
+    int rc;
+    char *sql;
+    const char *tail;
+    sqlite3_stmt *stmt;
 
-//normally
-    else{
-        filler(buf, ".history", NULL, 0);
-        filler(buf, ".deleted", NULL, 0);
-        getname_head(path);
-        while(i < num){
-	        filler(buf, name[i], NULL, 0);
-            i++;
+    if(to <= v->histid)
+        return;
+    sql = sqlite3_mprintf("SELECT op, name, type, mode, size, sha1, id FROM hist\
+            WHERE id > %lld AND id <= %lld ORDER BY id", v->histid, to);
+    rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return;
+    }
+
+    rc = sqlite3_step(stmt);
+    while(rc == SQLITE_ROW){
+        if(sqlite3_column_text(stmt, 0) == NULL || sqlite3_column_text(stmt, 1) == NULL ||
+                sqlite3_column_text(stmt, 2) == NULL){
+            rc = sqlite3_step(stmt);
+            continue;
         }
+        asof_apply(v, sqlite3_column_int64(stmt, 6), *sqlite3_column_text(stmt, 0),
+                (const char*)sqlite3_column_text(stmt, 1),
+                *sqlite3_column_text(stmt, 2),
+                sqlite3_column_int(stmt, 3),
+                sqlite3_column_int64(stmt, 4),
+                (const char*)sqlite3_column_text(stmt, 5));
+        rc = sqlite3_step(stmt);
     }
+    v->histid = to;
 
-    return 0;
+    sqlite3_finalize(stmt);
 }
 
-static int lunafuse_open(const char *path, struct fuse_file_info *fi)
-{
-	if ((fi->flags & 3) != O_RDONLY)
-		return -EACCES;
+/*
+ * a spilled checkpoint has the layout of a 'd' object: the object header,
+ * then one fs_head_t per entry with its name and chunk list and no vclock.
+ */
+static void asof_ckpt_write(box_t *b, int k, const asof_view_t *v){
+    int i, nlen, slen;
+    size_t n, len = 12;
+    char *buf;
+    fs_head_t *h;
+    off_t off;
 
-	return 0;
+    for(i = 0; i < v->num; i++)
+        len += sizeof(fs_head_t) + strlen(v->entry[i].name) + 1 + strlen(v->entry[i].sha1);
+    if(len - 12 > INT32_MAX)
+        return;
+    if(b->asof_spill == NULL && (b->asof_spill = tmpfile()) == NULL)
+        return;
+    if((buf = (char*)calloc(1, len)) == NULL)
+        return;
+    buf[0] = 'd';
+    buf[3] = (char)0xee;
+    *(int32_t*)(buf + 4) = (int32_t)(len - 12);
+    for(i = 0, n = 12; i < v->num; i++){
+        h = (fs_head_t*)(buf + n);
+        nlen = strlen(v->entry[i].name) + 1;
+        slen = strlen(v->entry[i].sha1);
+        h->struct_size = sizeof(fs_head_t) + nlen + slen;
+        h->type = v->entry[i].type;
+        h->op = 'a';
+        h->mode = v->entry[i].mode;
+        h->histid = v->entry[i].histid;
+        h->size = v->entry[i].size;
+        h->offset_sha1 = nlen;
+        h->offset_vclock = nlen + slen;
+        h->status = 'o';
+        memcpy(h->data, v->entry[i].name, nlen);
+        memcpy(h->data + nlen, v->entry[i].sha1, slen);
+        n += h->struct_size;
+    }
+    off = lseek(fileno(b->asof_spill), 0, SEEK_END);
+    if(off >= 0 && pwrite(fileno(b->asof_spill), buf, len, off) == (ssize_t)len)
+        b->asof_ckpt_off[k] = off;
+    free(buf);
 }
 
-static int lunafuse_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
-{
-    int fd, n, i = 0, j;
-    int in_res, res = 0;
-    off_t in_offset; 
-    int sha1_len;
-    char sha1_path[512];
-    size_t in_size = size;
-    char *p;
-    char tmp_path[512];
-    char tmp_name[512];
-    
-    (void) fi;
-    
-    if(strstr(path, "/.history/") != NULL){
-        strcpy(tmp_name, path);
-        getname_hist(tmp_name);
-        p = strrchr(path, '/');
-        j = p - path;
-        strncpy(tmp_path, path, j);
-        tmp_path[j] = '\0';
-        getsha1_dir(tmp_path);
-        strcpy(sha1_path, data_path);
-        strcat(sha1_path, sha1);
-        get_fs_head(sha1_path);
+static asof_view_t *asof_ckpt_read(box_t *b, int k){
+    int i, n;
+    int32_t len;
+    char *buf;
+    fs_head_t *h;
+    asof_view_t *v;
+    int fd = fileno(b->asof_spill);
+
+    if(pread(fd, &len, 4, b->asof_ckpt_off[k] + 4) != 4 || len < 0)
+        return NULL;
+    if((buf = (char*)malloc(len + 1)) == NULL)
+        return NULL;
+    if(pread(fd, buf, len, b->asof_ckpt_off[k] + 12) != len){
+        free(buf);
+        return NULL;
+    }
+    for(i = 0, n = 0; i < len; n++)
+        i += ((fs_head_t*)(buf + i))->struct_size;
+
+    v = asof_view_new();
+    v->histid = (int64_t)k * ASOF_INTERVAL;
+    v->num = v->cap = n;
+    if(n > 0)
+        v->entry = (asof_entry_t*)malloc(n * sizeof(asof_entry_t));
+    for(i = 0, n = 0; n < v->num; n++){
+        h = (fs_head_t*)(buf + i);
+        v->entry[n].name = strdup(fs_head_name(h));
+        v->entry[n].sha1 = strndup(fs_head_sha1(h), fs_head_sha1_size(h));
+        v->entry[n].type = h->type;
+        v->entry[n].mode = h->mode;
+        v->entry[n].size = h->size;
+        v->entry[n].histid = h->histid;
+        i += h->struct_size;
+    }
+    free(buf);
+    return v;
+}
+
+//checkpoint k, built from the closest lower one in memory or on disk
+static asof_view_t *asof_checkpoint(int k){
+    int i, j;
+    asof_view_t *v;
+    box_t *b = box_cur;
+
+    if(k >= b->asof_ckpt_num){
+        b->asof_ckpt = (asof_view_t**)realloc(b->asof_ckpt, (k + 1) * sizeof(asof_view_t*));
+        b->asof_ckpt_used = (uint64_t*)realloc(b->asof_ckpt_used, (k + 1) * sizeof(uint64_t));
+        b->asof_ckpt_off = (int64_t*)realloc(b->asof_ckpt_off, (k + 1) * sizeof(int64_t));
+        for(i = b->asof_ckpt_num; i <= k; i++){
+            b->asof_ckpt[i] = NULL;
+            b->asof_ckpt_used[i] = 0;
+            b->asof_ckpt_off[i] = -1;
+        }
+        b->asof_ckpt_num = k + 1;
+    }
+    if(b->asof_ckpt[0] == NULL)
+        b->asof_ckpt[0] = asof_view_new();
+
+    if(b->asof_ckpt[k] == NULL){
+        //a spilled one that cannot be read back is passed over
+        for(j = k; ; j--){
+            if(b->asof_ckpt[j] != NULL){
+                v = asof_view_copy(b->asof_ckpt[j]);
+                break;
+            }
+            if(b->asof_ckpt_off[j] >= 0 && (v = asof_ckpt_read(b, j)) != NULL)
+                break;
+        }
+        //walk up an interval at a time, spilling on the way
+        for(i = j + 1; i <= k; i++){
+            asof_replay(v, (int64_t)i * ASOF_INTERVAL);
+            if(i % ASOF_SPILL == 0 && b->asof_ckpt_off[i] < 0)
+                asof_ckpt_write(b, i, v);
+        }
+        b->asof_ckpt[k] = v;
+        b->asof_ckpt_live++;
+    }
+    b->asof_ckpt_used[k] = ++b->asof_tick;
+
+    //the empty view at 0 is always kept
+    while(b->asof_ckpt_live > ASOF_CHECKPOINTS){
+        j = -1;
+        for(i = 1; i < b->asof_ckpt_num; i++){
+            if(b->asof_ckpt[i] != NULL && i != k &&
+                    (j < 0 || b->asof_ckpt_used[i] < b->asof_ckpt_used[j]))
+                j = i;
+        }
+        asof_view_free(b->asof_ckpt[j]);
+        b->asof_ckpt[j] = NULL;
+        b->asof_ckpt_live--;
+    }
+    return b->asof_ckpt[k];
+}
+
+//last hist id at or before the timestamp, -1 if it cannot be parsed
+static int64_t asof_gethistid(const char *time_s){
+    int rc;
+    char *sql;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    const char *p;
+    int64_t t, id = 0;
+
+    for(p = time_s; *p >= '0' && *p <= '9'; p++)
+        ;
+    if(*time_s != '\0' && *p == '\0'){
+        t = atoll(time_s);
+    }else{
+        sql = sqlite3_mprintf("SELECT strftime('%%s', %Q)", time_s);
+        rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+        sqlite3_free(sql);
+        if(rc != SQLITE_OK)
+            return -1;
+        rc = sqlite3_step(stmt);
+        if(rc != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL){
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+        t = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+
+    sql = sqlite3_mprintf("SELECT max(id) FROM hist WHERE timestamp <= %lld", t);
+    rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW){
+        id = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return id;
+}
+
+/*
+ * split "/.asof/<time>/<rest>" and return the matching view, with
+ * the box's asof_lock held on success. rest is "/" for the view root.
+ */
+static asof_view_t *asof_open(const char *path, char *rest, size_t rest_len){
+    char time_s[64];
+    const char *p = path + 7;
+    const char *q = strchr(p, '/');
+    int len = q ? q - p : (int)strlen(p);
+    int64_t id;
+
+    if(len == 0 || len >= (int)sizeof(time_s) || (q && strlen(q) >= rest_len))
+        return NULL;
+    memcpy(time_s, p, len);
+    time_s[len] = '\0';
+    strcpy(rest, q ? q : "/");
+
+    pthread_mutex_lock(&box_cur->asof_lock);
+    if((id = asof_gethistid(time_s)) < 0){
+        pthread_mutex_unlock(&box_cur->asof_lock);
+        return NULL;
+    }
+    if(box_cur->asof_cur == NULL || box_cur->asof_cur->histid != id){
+        asof_view_free(box_cur->asof_cur);
+        box_cur->asof_cur = asof_view_copy(asof_checkpoint(id / ASOF_INTERVAL));
+        asof_replay(box_cur->asof_cur, id);
+    }
+    return box_cur->asof_cur;
+}
+
+static int asof_getattr(const char *path, struct stat *stbuf){
+    int i, found;
+    char rest[512];
+    asof_view_t *v;
+
+    if(strcmp(path, "/.asof") == 0){
+        stbuf->st_mode = S_IFDIR | 493;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    if((v = asof_open(path, rest, sizeof(rest))) == NULL)
+        return -ENOENT;
+
+    i = asof_find(v, rest, &found);
+    if(strcmp(rest, "/") == 0){
+        stbuf->st_mode = S_IFDIR | 493;
+        stbuf->st_nlink = 2;
+    }else if(!found){
+        pthread_mutex_unlock(&box_cur->asof_lock);
+        return -ENOENT;
+    }else if(v->entry[i].type == 'd'){
+        stbuf->st_mode = S_IFDIR | v->entry[i].mode;
+        stbuf->st_nlink = 2;
+    }else{
+        stbuf->st_mode = S_IFREG | v->entry[i].mode;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = v->entry[i].size;
+    }
+    pthread_mutex_unlock(&box_cur->asof_lock);
+    return 0;
+}
+
+static int asof_readdir(const char *path, void *buf, fuse_fill_dir_t filler){
+    int i, len;
+    char rest[512];
+    char *name;
+    asof_view_t *v;
+
+    if(strcmp(path, "/.asof") == 0)
+        return 0;
+    if((v = asof_open(path, rest, sizeof(rest))) == NULL)
+        return -ENOENT;
+
+    len = strcmp(rest, "/") == 0 ? 0 : strlen(rest);
+    for(i = 0; i < v->num; i++){
+        name = v->entry[i].name;
+        if(strncmp(name, rest, len) == 0 && name[len] == '/' &&
+                name[len + 1] != '\0' && strchr(name + len + 1, '/') == NULL)
+            filler(buf, name + len + 1, NULL, 0);
+    }
+    pthread_mutex_unlock(&box_cur->asof_lock);
+    return 0;
+}
+
+static int getsha1_asof(const char *path, char **list){
+    int i, found, res = 0;
+    char rest[512];
+    asof_view_t *v;
+
+    *list = NULL;
+    if((v = asof_open(path, rest, sizeof(rest))) == NULL)
+        return 0;
+    i = asof_find(v, rest, &found);
+    if(found && v->entry[i].type == 'f'){
+        res = setsha1(list, v->entry[i].sha1, strlen(v->entry[i].sha1));
+    }
+    pthread_mutex_unlock(&box_cur->asof_lock);
+    return res;
+}
+
+/*
+ * with -o trace=<file>, every getattr/readdir/open/read/release is recorded into a
+ * per-thread ring (single producer, drained by the flusher thread, no lock
+ * on the fs path) and written out as a compact binary trace. a full ring
+ * drops the record and counts it. lunafuse -r <file> replays a trace.
+ */
+#define TRACE_GETATTR  1
+#define TRACE_READDIR  2
+#define TRACE_OPEN     3
+#define TRACE_READ     4
+#define TRACE_RELEASE  5
+
+#pragma pack(push, 1)
+
+typedef struct trace_rec_t {
+    uint64_t  ts;               /* ns since the trace was started       */
+    int64_t   offset;           /* read offset                          */
+    uint32_t  size;             /* read size                            */
+    uint32_t  tid;              /* kernel thread id of the caller       */
+    uint8_t   op;               /* TRACE_*                              */
+    uint16_t  path_len;         /* followed by the path, no '\0'        */
+} trace_rec_t;
+
+#pragma pack(pop)
+
+typedef struct trace_ring_t {
+    unsigned     head;          /* next slot, written by the owner      */
+    unsigned     tail;          /* next slot, written by the flusher    */
+    int          owner;         /* a live thread is writing to it       */
+    uint64_t     dropped;
+    struct {
+        trace_rec_t rec;
+        char        path[512];
+    } slot[TRACE_SLOTS];
+} trace_ring_t;
+
+static char trace_path[512];
+static FILE *trace_file;
+static struct timespec trace_start;
+static trace_ring_t *trace_rings[TRACE_RINGS];
+static int trace_nring = 0;
+static int trace_stop = 0;
+static pthread_t trace_thread;
+static pthread_key_t trace_key;
+static __thread trace_ring_t *trace_ring;
+
+static uint64_t trace_now(void){
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)(t.tv_sec - trace_start.tv_sec) * 1000000000ULL
+        + t.tv_nsec - trace_start.tv_nsec;
+}
+
+//the ring goes back to the pool when its thread exits
+static void trace_release(void *arg){
+    __atomic_store_n(&((trace_ring_t*)arg)->owner, 0, __ATOMIC_RELEASE);
+}
+
+//rings published so far; a slot below it may still be NULL while being set up
+static int trace_nrings(void){
+    int n = __atomic_load_n(&trace_nring, __ATOMIC_ACQUIRE);
+
+    return n < TRACE_RINGS ? n : TRACE_RINGS;
+}
+
+static trace_ring_t *trace_claim(void){
+    int i, n, idle;
+    trace_ring_t *r;
+
+    n = trace_nrings();
+    for(i = 0; i < n; i++){
+        idle = 0;
+        if((r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE)) == NULL)
+            continue;
+        if(__atomic_compare_exchange_n(&r->owner, &idle, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return r;
+    }
+    i = __atomic_load_n(&trace_nring, __ATOMIC_ACQUIRE);
+    do{
+        if(i >= TRACE_RINGS)
+            return NULL;
+    }while(!__atomic_compare_exchange_n(&trace_nring, &i, i + 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    r = (trace_ring_t*)calloc(1, sizeof(trace_ring_t));
+    r->owner = 1;
+    __atomic_store_n(&trace_rings[i], r, __ATOMIC_RELEASE);
+    return r;
+}
+
+static void trace_op(int op, const char *path, off_t offset, size_t size){
+    unsigned head;
+    int len = strlen(path);
+    trace_ring_t *r = trace_ring;
+
+    if(r == NULL){
+        if((r = trace_claim()) == NULL)
+            return;
+        trace_ring = r;
+        pthread_setspecific(trace_key, r);
+    }
+    head = r->head;
+    if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_SLOTS){
+        r->dropped++;
+        return;
+    }
+    if(len > (int)sizeof(r->slot[0].path))
+        len = sizeof(r->slot[0].path);
+    r->slot[head % TRACE_SLOTS].rec.ts = trace_now();
+    r->slot[head % TRACE_SLOTS].rec.offset = offset;
+    r->slot[head % TRACE_SLOTS].rec.size = size;
+    r->slot[head % TRACE_SLOTS].rec.tid = syscall(SYS_gettid);
+    r->slot[head % TRACE_SLOTS].rec.op = op;
+    r->slot[head % TRACE_SLOTS].rec.path_len = len;
+    memcpy(r->slot[head % TRACE_SLOTS].path, path, len);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_drain(void){
+    int i, n;
+    unsigned head, tail;
+    trace_ring_t *r;
+
+    n = trace_nrings();
+    for(i = 0; i < n; i++){
+        if((r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE)) == NULL)
+            continue;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for(tail = r->tail; tail != head; tail++){
+            fwrite(&r->slot[tail % TRACE_SLOTS].rec, sizeof(trace_rec_t), 1, trace_file);
+            fwrite(r->slot[tail % TRACE_SLOTS].path, 1,
+                    r->slot[tail % TRACE_SLOTS].rec.path_len, trace_file);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    fflush(trace_file);
+}
+
+static void *trace_flusher(void *arg){
+    struct timespec t = {0, 10000000};
+    (void) arg;
+
+    while(!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE)){
+        trace_drain();
+        nanosleep(&t, NULL);
+    }
+    trace_drain();
+    return NULL;
+}
+
+static int trace_begin(void){
+    if((trace_file = fopen(trace_path, "wb")) == NULL){
+        fprintf(stderr, "cannot open trace:%s\n", trace_path);
+        return -1;
+    }
+    fwrite(TRACE_MAGIC, 1, 8, trace_file);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    pthread_key_create(&trace_key, trace_release);
+    pthread_create(&trace_thread, NULL, trace_flusher, NULL);
+    return 0;
+}
+
+static void trace_end(void){
+    int i, n;
+    uint64_t dropped = 0;
+    trace_ring_t *r;
+
+    __atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+    n = trace_nrings();
+    for(i = 0; i < n; i++){
+        if((r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE)) != NULL)
+            dropped += r->dropped;
+    }
+    if(dropped > 0)
+        fprintf(stderr, "trace: %llu records dropped\n", (unsigned long long)dropped);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+static int lunafuse_getattr(const char *path, struct stat *stbuf)
+{
+	int res = 0, i = 0, j;
+    int len = strlen(path);
+    char *p, *q;
+    char tmp_path[512];
+    char tmp_name[512];
+    char sha1_path[512];
+    char dir_id[SHA1_LEN + 1];
+	memset(stbuf, 0, sizeof(struct stat));
+
+    if(strncmp(path, "/.asof", 6) == 0 && (path[6] == '\0' || path[6] == '/')){
+        return asof_getattr(path, stbuf);
+    }
+
+	if (strcmp(path, "/") == 0 ||
+        (len > 8 && strcmp(path + len -8, ".history") == 0)||
+        ((p = strstr(path, "/.history")) != NULL && *(p + 29) != '/')
+        || ((q = strstr(path, "/.deleted")) != NULL && *(q + 9) != '/')){ 
+		stbuf->st_mode = S_IFDIR | 493;
+		stbuf->st_nlink = 2;
+	} 
+
+    else if(strstr(path, "/.history/") != NULL){
+        strcpy(tmp_name, path);
+        getname_hist(tmp_name);
+        p = strrchr(path, '/');
+        j = p - path;
+        strncpy(tmp_path, path, j);
+        tmp_path[j] = '\0';
+        getsha1_dir(tmp_path, dir_id);
+        strcpy(sha1_path, data_path);
+        strcat(sha1_path, dir_id);
+        get_fs_head(sha1_path);
+
+        while(i < num){
+            if(strcmp(tmp_name, fs_head_name(head[i])) == 0){
+                if(head[i]->type == 'd'){
+                    stbuf->st_mode = S_IFDIR | head[i]->mode;
+		            stbuf->st_nlink = 2;
+                }else{
+                    stbuf->st_mode = S_IFREG | head[i]->mode;
+		            stbuf->st_nlink = 1;
+                }
+                stbuf->st_size = head[i]->size; 
+                break;
+            }
+            i++;
+        }
+    }
+    
+    else if(strstr(path, "/.deleted/") != NULL){
+        strcpy(tmp_path, path);
+        getname_hist(tmp_path);
+        stbuf->st_mode = S_IFREG | getmode_del(tmp_path);
+	    stbuf->st_nlink = 1;
+		stbuf->st_size = getsize_del(tmp_path);
+    }
+
+	else {
+        if(gettype_head(path) == 'd'){
+		            stbuf->st_mode = S_IFDIR | getmode_head(path);
+		            stbuf->st_nlink = 2;
+        }
+        else if(gettype_head(path) == 'f'){
+                    stbuf->st_mode = S_IFREG | getmode_head(path);
+		            stbuf->st_nlink = 1;
+            }
+            else res = -ENOENT;
+		stbuf->st_size = getsize_head(path);
+		//stbuf->st_mtime = getmtime_head(path);
+		//stbuf->st_ctime = getctime_head(path);
+    }
+
+	return res;
+}
+
+static int lunafuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	(void) offset;
+	(void) fi;
+    int i = 0, n, j, len;
+    char *p;
+    char *q;
+    char timename[20];
+    char tmp_path[512];
+    char sha1_path[512];
+    char dir_id[SHA1_LEN + 1];
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+
+//the point-in-time view
+    if(strncmp(path, "/.asof", 6) == 0 && (path[6] == '\0' || path[6] == '/')){
+        return asof_readdir(path, buf, filler);
+    }
+
+//under the history dir to filler the time dir
+    else if(strcmp(p = strrchr(path, '/'), "/.history") == 0){
+        gettime_hist(path);
+        while(i < num){
+		    filler(buf, time_f[i], NULL, 0);
+            i++;
+        }
+    }
+
+//under the time dir to filler the file
+    else if((q = strstr(path, "/.history/")) != NULL ){
+        getsha1_dir(path, dir_id);
+        strcpy(sha1_path, data_path);
+        strcat(sha1_path, dir_id);
+        get_fs_head(sha1_path);
+        if(strlen(dir_id) == 0){
+            num = 0;
+        }
+        while(i < num){
+            p = strrchr(fs_head_name(head[i]), '/');
+            j = p - fs_head_name(head[i]) + 1;
+            filler(buf, fs_head_name(head[i]) + j, NULL, 0);
+            i++;
+        }
+    }
+
+//filler deleted file
+    else if((p = strstr(path, "/.deleted")) != NULL){
+            strcpy(tmp_path, path);
+            getname_hist(tmp_path);
+            getname_del(tmp_path); 
+            while(i < num){
+                filler(buf, name[i], NULL, 0);
+                i++;
+            }
+        }    
+
+//normally
+    else{
+        if(strcmp(path, "/") == 0){
+            filler(buf, ".asof", NULL, 0);
+        }
+        filler(buf, ".history", NULL, 0);
+        filler(buf, ".deleted", NULL, 0);
+        getname_head(path);
+        while(i < num){
+	        filler(buf, name[i], NULL, 0);
+            i++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * chunk objects never change once written, so with -o mmap_chunks they are
+ * mapped on first use and reads are served with memcpy from the mapping.
+ * at most MMAP_CHUNKS mappings are kept, found through a hash of their
+ * sha1; idle ones sit on an lru list and the oldest is dropped to make
+ * room. the lock only covers the tables: a slot is reserved, mapped
+ * without the lock and then published, and pread is used meanwhile or
+ * when every slot is busy.
+ */
+#define MMAP_BUCKETS (MMAP_CHUNKS * 2)
+
+typedef struct chunk_map_t {
+    char      id[SHA1_LEN + 1];
+    char     *addr;             /* NULL while being mapped              */
+    size_t    len;              /* whole object, header included        */
+    int       ref;              /* readers currently copying from it    */
+    int       next;             /* next slot + 1 in its bucket, 0 ends  */
+    int       idle_prev;        /* lru list of slots with ref 0, slot + 1 */
+    int       idle_next;
+} chunk_map_t;
+
+static int mmap_chunks = 0;
+static chunk_map_t chunk_map[MMAP_CHUNKS];
+static int chunk_map_used = 0;
+static int chunk_bucket[MMAP_BUCKETS];  /* first slot + 1, 0 when empty */
+static int chunk_idle_head = 0;         /* least recently used, slot + 1 */
+static int chunk_idle_tail = 0;
+static pthread_mutex_t chunk_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int chunk_map_hash(const char *id){
+    int i;
+    unsigned int h = 0;
+
+    for(i = 0; i < 8; i++)
+        h = h * 16 + (id[i] <= '9' ? id[i] - '0' : (id[i] | 0x20) - 'a' + 10);
+    return h % MMAP_BUCKETS;
+}
+
+static void chunk_idle_unlink(int x){
+    chunk_map_t *m = &chunk_map[x];
+
+    if(m->idle_prev)
+        chunk_map[m->idle_prev - 1].idle_next = m->idle_next;
+    else
+        chunk_idle_head = m->idle_next;
+    if(m->idle_next)
+        chunk_map[m->idle_next - 1].idle_prev = m->idle_prev;
+    else
+        chunk_idle_tail = m->idle_prev;
+    m->idle_prev = m->idle_next = 0;
+}
+
+static void chunk_idle_push(int x){
+    chunk_map_t *m = &chunk_map[x];
+
+    m->idle_prev = chunk_idle_tail;
+    m->idle_next = 0;
+    if(chunk_idle_tail)
+        chunk_map[chunk_idle_tail - 1].idle_next = x + 1;
+    else
+        chunk_idle_head = x + 1;
+    chunk_idle_tail = x + 1;
+}
+
+static void chunk_hash_remove(int x){
+    int *p = &chunk_bucket[chunk_map_hash(chunk_map[x].id)];
+
+    while(*p != x + 1)
+        p = &chunk_map[*p - 1].next;
+    *p = chunk_map[x].next;
+    chunk_map[x].id[0] = '\0';
+}
+
+static chunk_map_t *chunk_map_get(const char *id){
+    int x, fd, h = chunk_map_hash(id);
+    struct stat st;
+    char sha1_path[512];
+    chunk_map_t *m;
+    void *addr = NULL;
+    void *old_addr = NULL;
+    size_t old_len = 0;
+
+    pthread_mutex_lock(&chunk_map_lock);
+    for(x = chunk_bucket[h]; x != 0; x = chunk_map[x - 1].next){
+        m = &chunk_map[x - 1];
+        if(strncmp(m->id, id, SHA1_LEN) == 0){
+            if(m->addr == NULL){
+                pthread_mutex_unlock(&chunk_map_lock);
+                return NULL;
+            }
+            if(m->ref++ == 0)
+                chunk_idle_unlink(x - 1);
+            pthread_mutex_unlock(&chunk_map_lock);
+            return m;
+        }
+    }
+
+    if(chunk_map_used < MMAP_CHUNKS){
+        x = chunk_map_used++;
+    }else if(chunk_idle_head != 0){
+        x = chunk_idle_head - 1;
+        chunk_idle_unlink(x);
+        if(chunk_map[x].id[0] != '\0')
+            chunk_hash_remove(x);
+        old_addr = chunk_map[x].addr;
+        old_len = chunk_map[x].len;
+    }else{
+        pthread_mutex_unlock(&chunk_map_lock);
+        return NULL;
+    }
+    m = &chunk_map[x];
+    strncpy(m->id, id, SHA1_LEN);
+    m->id[SHA1_LEN] = '\0';
+    m->addr = NULL;
+    m->ref = 1;
+    m->next = chunk_bucket[h];
+    chunk_bucket[h] = x + 1;
+    pthread_mutex_unlock(&chunk_map_lock);
+
+    if(old_addr != NULL)
+        munmap(old_addr, old_len);
+    strcpy(sha1_path, data_path);
+    strncat(sha1_path, id, SHA1_LEN);
+    if((fd = open(sha1_path, O_RDONLY)) != -1){
+        if(fstat(fd, &st) == 0 && st.st_size >= 12 &&
+                (addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED)
+            madvise(addr, st.st_size, MADV_WILLNEED);
+        else
+            addr = NULL;
+        close(fd);
+    }
+
+    pthread_mutex_lock(&chunk_map_lock);
+    if(addr == NULL){
+        chunk_hash_remove(x);
+        m->ref = 0;
+        chunk_idle_push(x);
+        m = NULL;
+    }else{
+        m->addr = (char*)addr;
+        m->len = st.st_size;
+    }
+    pthread_mutex_unlock(&chunk_map_lock);
+    return m;
+}
+
+static void chunk_map_put(chunk_map_t *m){
+    pthread_mutex_lock(&chunk_map_lock);
+    if(--m->ref == 0)
+        chunk_idle_push(m - chunk_map);
+    pthread_mutex_unlock(&chunk_map_lock);
+}
+
+//read from the payload of one chunk object, offset is relative to the payload
+static int read_chunk(const char *id, char *buf, size_t size, off_t offset){
+    int fd, res;
+    char sha1_path[512];
+    chunk_map_t *m;
+
+    if(mmap_chunks && (m = chunk_map_get(id)) != NULL){
+        if(offset + 12 >= (off_t)m->len){
+            res = 0;
+        }else{
+            if(size > m->len - 12 - offset)
+                size = m->len - 12 - offset;
+            memcpy(buf, m->addr + 12 + offset, size);
+            res = size;
+        }
+        chunk_map_put(m);
+        return res;
+    }
+
+    strcpy(sha1_path, data_path);
+    strncat(sha1_path, id, SHA1_LEN);
+    fd = open(sha1_path, O_RDONLY);
+    if(fd == -1)
+        return -errno;
+    res = pread(fd, buf, size, offset + 12);
+    if(res == -1)
+        res = -errno;
+    close(fd);
+    return res;
+}
+
+/*
+ * sha1 of chunk objects for -o verify. an object is named by the sha1 of
+ * its whole content, header included. the compression function uses the
+ * SHA-NI instructions when the cpu has them and portable code otherwise.
+ * with verify=first a verified sha1 is remembered and never hashed again.
+ */
+#define VERIFY_FIRST   1
+#define VERIFY_ALWAYS  2
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_blocks_c(uint32_t h[5], const unsigned char *data, size_t blocks){
+    int i;
+    uint32_t w[80], a, b, c, d, e, t;
+
+    while(blocks-- > 0){
+        for(i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4*i] << 24 | (uint32_t)data[4*i + 1] << 16
+                | (uint32_t)data[4*i + 2] << 8 | data[4*i + 3];
+        for(i = 16; i < 80; i++)
+            w[i] = ROL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for(i = 0; i < 20; i++){
+            t = ROL32(a, 5) + ((b & c) | (~b & d)) + e + 0x5a827999 + w[i];
+            e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+        }
+        for(; i < 40; i++){
+            t = ROL32(a, 5) + (b ^ c ^ d) + e + 0x6ed9eba1 + w[i];
+            e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+        }
+        for(; i < 60; i++){
+            t = ROL32(a, 5) + ((b & c) | (b & d) | (c & d)) + e + 0x8f1bbcdc + w[i];
+            e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+        }
+        for(; i < 80; i++){
+            t = ROL32(a, 5) + (b ^ c ^ d) + e + 0xca62c1d6 + w[i];
+            e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+        data += 64;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//four rounds of the steady state: m0 feeds the rounds, the others advance the schedule
+#define SHANI_ROUNDS(ea, eb, m0, m1, m2, m3, f) \
+    ea = _mm_sha1nexte_epu32(ea, m0); \
+    eb = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_shani(uint32_t h[5], const unsigned char *data, size_t blocks){
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i m0, m1, m2, m3;
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1b);
+    e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    while(blocks-- > 0){
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+        SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+        SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+        SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+        SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+        SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+        SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+        SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+        SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+        SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+        SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int cpu_has_shani(void){
+    unsigned a, b, c, d;
+
+    if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+        return 0;
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return 0;
+    return (b & bit_SHA) != 0;
+}
+
+#else
+
+static int cpu_has_shani(void){
+    return 0;
+}
+
+#endif
+
+static void (*sha1_blocks)(uint32_t h[5], const unsigned char *data, size_t blocks) = sha1_blocks_c;
+
+static void sha1_init(void){
+#if defined(__x86_64__) || defined(__i386__)
+    if(cpu_has_shani())
+        sha1_blocks = sha1_blocks_shani;
+#endif
+}
+
+static void sha1_digest(const unsigned char *data, size_t len, unsigned char out[20]){
+    int i, n;
+    uint64_t bits = (uint64_t)len * 8;
+    unsigned char tail[128];
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    sha1_blocks(h, data, len / 64);
+    n = len % 64;
+    memcpy(tail, data + len - n, n);
+    tail[n++] = 0x80;
+    while(n % 64 != 56)
+        tail[n++] = 0;
+    for(i = 7; i >= 0; i--)
+        tail[n++] = bits >> (8 * i);
+    sha1_blocks(h, tail, n / 64);
+
+    for(i = 0; i < 20; i++)
+        out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+//set of verified sha1s, open addressing on the leading bytes of the digest
+static int verify_mode = 0;
+static unsigned char (*verified)[20];
+static size_t verified_cap = 0;
+static size_t verified_num = 0;
+static uint64_t verify_failures = 0;
+static pthread_mutex_t verified_lock = PTHREAD_MUTEX_INITIALIZER;
+static const unsigned char sha1_zero[20];
+
+static size_t verified_slot(unsigned char (*set)[20], size_t cap, const unsigned char *md){
+    size_t i;
+
+    memcpy(&i, md, sizeof(i));
+    for(i &= cap - 1; memcmp(set[i], sha1_zero, 20) != 0 && memcmp(set[i], md, 20) != 0;
+            i = (i + 1) & (cap - 1))
+        ;
+    return i;
+}
+
+static int verified_has(const unsigned char *md){
+    int res = 0;
+
+    pthread_mutex_lock(&verified_lock);
+    if(verified_cap > 0)
+        res = memcmp(verified[verified_slot(verified, verified_cap, md)], md, 20) == 0;
+    pthread_mutex_unlock(&verified_lock);
+    return res;
+}
+
+static void verified_add(const unsigned char *md){
+    size_t i, cap;
+    unsigned char (*set)[20];
+
+    pthread_mutex_lock(&verified_lock);
+    if(2 * (verified_num + 1) > verified_cap){
+        cap = verified_cap ? verified_cap * 2 : 4096;
+        set = (unsigned char (*)[20])calloc(cap, 20);
+        for(i = 0; i < verified_cap; i++){
+            if(memcmp(verified[i], sha1_zero, 20) != 0)
+                memcpy(set[verified_slot(set, cap, verified[i])], verified[i], 20);
+        }
+        free(verified);
+        verified = set;
+        verified_cap = cap;
+    }
+    i = verified_slot(verified, verified_cap, md);
+    if(memcmp(verified[i], md, 20) != 0){
+        memcpy(verified[i], md, 20);
+        verified_num++;
+    }
+    pthread_mutex_unlock(&verified_lock);
+}
+
+static int sha1_from_hex(const char *id, unsigned char *md){
+    int i, hi, lo;
+
+    for(i = 0; i < 20; i++){
+        hi = id[2*i];
+        lo = id[2*i + 1];
+        hi = hi >= 'a' ? hi - 'a' + 10 : hi >= 'A' ? hi - 'A' + 10 : hi - '0';
+        lo = lo >= 'a' ? lo - 'a' + 10 : lo >= 'A' ? lo - 'A' + 10 : lo - '0';
+        if(hi < 0 || hi > 15 || lo < 0 || lo > 15)
+            return -1;
+        md[i] = hi << 4 | lo;
+    }
+    return 0;
+}
+
+//0 when the object matches its name, -EIO (and counted) when it does not
+static int verify_chunk(const char *id){
+    int fd, res = 0;
+    struct stat st;
+    unsigned char want[20], got[20];
+    char sha1_path[512];
+    unsigned char *data;
+    chunk_map_t *m;
+
+    if(sha1_from_hex(id, want) != 0)
+        return -EIO;
+    if(verify_mode == VERIFY_FIRST && verified_has(want))
+        return 0;
+
+    if(mmap_chunks && (m = chunk_map_get(id)) != NULL){
+        sha1_digest((unsigned char*)m->addr, m->len, got);
+        chunk_map_put(m);
+    }else{
+        strcpy(sha1_path, data_path);
+        strncat(sha1_path, id, SHA1_LEN);
+        if((fd = open(sha1_path, O_RDONLY)) == -1)
+            return -errno;
+        if(fstat(fd, &st) == -1){
+            res = -errno;
+            close(fd);
+            return res;
+        }
+        data = (unsigned char*)malloc(st.st_size > 0 ? st.st_size : 1);
+        if(pread(fd, data, st.st_size, 0) != st.st_size)
+            res = -EIO;
+        close(fd);
+        if(res == 0)
+            sha1_digest(data, st.st_size, got);
+        free(data);
+        if(res != 0)
+            return res;
+    }
+
+    if(memcmp(want, got, 20) != 0){
+        fprintf(stderr, "sha1 mismatch:%.40s (%llu failures)\n", id,
+                (unsigned long long)__atomic_add_fetch(&verify_failures, 1, __ATOMIC_RELAXED));
+        return -EIO;
+    }
+    if(verify_mode == VERIFY_FIRST)
+        verified_add(want);
+    return 0;
+}
+
+/*
+ * chunks are not assumed to be SHA1_MAX long: when a chunk list is first
+ * read, the payload length of every chunk is taken from its object header
+ * and turned into a prefix sum of file offsets, which reads binary-search.
+ * the last CHUNK_INDEXES lists are cached, keyed by the sha1 list itself.
+ */
+typedef struct chunk_index_t {
+    char     *ids;              /* concatenated sha1 list               */
+    int       n;                /* number of chunks                     */
+    int64_t  *off;              /* off[i]: file offset of chunk i,
+                                   off[n]: file size                    */
+    int       ref;
+    uint64_t  tick;
+} chunk_index_t;
+
+static chunk_index_t chunk_index[CHUNK_INDEXES];
+static uint64_t index_tick = 0;
+static pthread_mutex_t chunk_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//payload length from the 12-byte object header
+static int64_t getsize_chunk(const char *id){
+    int fd, res;
+    char hdr[12];
+    char sha1_path[512];
+
+    strcpy(sha1_path, data_path);
+    strncat(sha1_path, id, SHA1_LEN);
+    fd = open(sha1_path, O_RDONLY);
+    if(fd == -1)
+        return -errno;
+    res = pread(fd, hdr, 12, 0);
+    close(fd);
+    if(res != 12)
+        return -EIO;
+    return *(int32_t*)(hdr + 4);
+}
+
+static chunk_index_t *chunk_index_get(const char *ids, int *err){
+    int i, n, victim = -1;
+    int64_t len, *off;
+    chunk_index_t *x;
+
+    *err = 0;
+    pthread_mutex_lock(&chunk_index_lock);
+    for(i = 0; i < CHUNK_INDEXES; i++){
+        x = &chunk_index[i];
+        if(x->ids != NULL && strcmp(x->ids, ids) == 0){
+            x->ref++;
+            x->tick = ++index_tick;
+            pthread_mutex_unlock(&chunk_index_lock);
+            return x;
+        }
+        if(x->ref == 0 && (victim < 0 || x->ids == NULL ||
+                (chunk_index[victim].ids != NULL && x->tick < chunk_index[victim].tick)))
+            victim = i;
+    }
+    pthread_mutex_unlock(&chunk_index_lock);
+
+    //headers are read without the lock, a racing reader may build the same list
+    n = strlen(ids) / SHA1_LEN;
+    off = (int64_t*)malloc((n + 1) * sizeof(int64_t));
+    off[0] = 0;
+    for(i = 0; i < n; i++){
+        if((len = getsize_chunk(ids + i*SHA1_LEN)) < 0){
+            free(off);
+            *err = (int)len;
+            return NULL;
+        }
+        off[i + 1] = off[i] + len;
+    }
+
+    pthread_mutex_lock(&chunk_index_lock);
+    if(victim < 0 || chunk_index[victim].ref != 0){
+        for(victim = 0; victim < CHUNK_INDEXES && chunk_index[victim].ref != 0; victim++)
+            ;
+    }
+    if(victim == CHUNK_INDEXES){
+        pthread_mutex_unlock(&chunk_index_lock);
+        //every slot is busy: hand out a private index, freed by the put
+        x = (chunk_index_t*)calloc(1, sizeof(chunk_index_t));
+        x->ids = strdup(ids);
+        x->n = n;
+        x->off = off;
+        x->ref = -1;
+        return x;
+    }
+    x = &chunk_index[victim];
+    free(x->ids);
+    free(x->off);
+    x->ids = strdup(ids);
+    x->n = n;
+    x->off = off;
+    x->ref = 1;
+    x->tick = ++index_tick;
+    pthread_mutex_unlock(&chunk_index_lock);
+    return x;
+}
+
+static void chunk_index_put(chunk_index_t *x){
+    if(x->ref < 0){
+        free(x->ids);
+        free(x->off);
+        free(x);
+        return;
+    }
+    pthread_mutex_lock(&chunk_index_lock);
+    x->ref--;
+    pthread_mutex_unlock(&chunk_index_lock);
+}
+
+//the chunk holding offset: last i with off[i] <= offset, so empty chunks are skipped
+static int chunk_index_find(const chunk_index_t *x, int64_t offset){
+    int lo = 0, hi = x->n, mid;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(x->off[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/*
+ * with -o uring, the chunk segments of one read are submitted together as
+ * an io_uring batch (plus a readahead hint for the chunk that follows) and
+ * reaped at once, instead of one open+pread+close after another. each
+ * thread sets up its own ring on first use; when io_uring is not available
+ * the reads go through pread as before.
+ */
+typedef struct chunk_seg_t {
+    const char *id;
+    char       *buf;
+    size_t      size;
+    off_t       offset;         /* relative to the chunk payload        */
+} chunk_seg_t;
+
+typedef struct uring_t {
+    int                  fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t               sq_len;
+    size_t               cq_len;
+    size_t               sqes_len;
+} uring_t;
+
+static int use_uring = 0;
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static uring_t uring_none;          /* marks a thread whose setup failed */
+
+static void uring_free(void *arg){
+    uring_t *u = (uring_t*)arg;
+
+    if(u == NULL || u == &uring_none)
+        return;
+    munmap(u->sqes, u->sqes_len);
+    if(u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+    free(u);
+}
+
+static void uring_key_init(void){
+    pthread_key_create(&uring_key, uring_free);
+}
+
+static uring_t *uring_get(void){
+    struct io_uring_params p;
+    uring_t *u;
+    char *sq, *cq;
+
+    pthread_once(&uring_once, uring_key_init);
+    if((u = (uring_t*)pthread_getspecific(uring_key)) != NULL)
+        return u == &uring_none ? NULL : u;
+
+    pthread_setspecific(uring_key, &uring_none);
+    u = (uring_t*)calloc(1, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    if((u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) < 0){
+        free(u);
+        return NULL;
+    }
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_ring == MAP_FAILED){
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        u->cq_ring = u->sq_ring;
+    }else{
+        u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cq_ring == MAP_FAILED){
+            munmap(u->sq_ring, u->sq_len);
+            close(u->fd);
+            free(u);
+            return NULL;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED){
+        u->sqes = NULL;
+        if(u->cq_ring != u->sq_ring)
+            munmap(u->cq_ring, u->cq_len);
+        munmap(u->sq_ring, u->sq_len);
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+
+    sq = (char*)u->sq_ring;
+    cq = (char*)u->cq_ring;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    pthread_setspecific(uring_key, u);
+    return u;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *u, int fd, __u64 data){
+    unsigned tail = *u->sq_tail;
+    unsigned k = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[k];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = data;
+    u->sq_array[k] = k;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * submit count sqes and reap every one the kernel took, res[user_data]
+ * gets each result. nothing is left in flight on return, even on error:
+ * the sqes point at the caller's iovecs, buffers and fds, and a late cqe
+ * would be credited to the next batch. sqes that were not taken are
+ * dropped from the ring.
+ */
+static int uring_wait(uring_t *u, int count, int *res, int nres){
+    int submitted = 0, done = 0, rc, err = 0;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+
+    while(submitted < count && err == 0){
+        rc = syscall(__NR_io_uring_enter, u->fd, count - submitted, 0, 0, NULL, 0);
+        if(rc > 0)
+            submitted += rc;
+        else if(rc == 0)
+            err = -EIO;
+        else if(errno != EINTR)
+            err = -errno;
+    }
+    if(submitted < count)
+        __atomic_store_n(u->sq_tail, __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE),
+                __ATOMIC_RELEASE);
+
+    while(done < submitted){
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail){
+            cqe = &u->cqes[head & *u->cq_mask];
+            if(cqe->user_data < (__u64)nres)
+                res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if(done >= submitted)
+            break;
+        rc = syscall(__NR_io_uring_enter, u->fd, 0, submitted - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        //keep reaping whatever the error, the completions still arrive
+        if(rc < 0 && errno != EINTR){
+            if(err == 0)
+                err = -errno;
+            sched_yield();
+        }
+    }
+    return err;
+}
+
+//returns -ENOSYS when the caller should use pread instead
+static int uring_read_segs(chunk_seg_t *seg, int n, const char *ra){
+    int i, j, k, count, hint, total = 0, err = 0;
+    int fd[URING_DEPTH], res[URING_DEPTH];
+    struct iovec iov[URING_DEPTH];
+    char sha1_path[512];
+    struct io_uring_sqe *sqe;
+    uring_t *u;
+
+    if((u = uring_get()) == NULL)
+        return -ENOSYS;
+
+    //one slot is kept for the readahead hint
+    for(i = 0; i < n && err == 0; i += URING_DEPTH - 1){
+        count = n - i < URING_DEPTH - 1 ? n - i : URING_DEPTH - 1;
+        for(k = 0; k < count; k++){
+            strcpy(sha1_path, data_path);
+            strncat(sha1_path, seg[i + k].id, SHA1_LEN);
+            if((fd[k] = open(sha1_path, O_RDONLY)) == -1){
+                err = -errno;
+                break;
+            }
+        }
+        if(k < count){
+            for(j = 0; j < k; j++)
+                close(fd[j]);
+            //a chunk that cannot be opened only fails the read if nothing came before it
+            return i + k == 0 ? err : total;
+        }
+        for(k = 0; k < count; k++){
+            iov[k].iov_base = seg[i + k].buf;
+            iov[k].iov_len = seg[i + k].size;
+            sqe = uring_sqe(u, fd[k], k);
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr = (__u64)(uintptr_t)&iov[k];
+            sqe->len = 1;
+            sqe->off = seg[i + k].offset + 12;
+        }
+        hint = 0;
+        if(ra != NULL && i + count == n){
+            strcpy(sha1_path, data_path);
+            strncat(sha1_path, ra, SHA1_LEN);
+            if((fd[count] = open(sha1_path, O_RDONLY)) != -1){
+                sqe = uring_sqe(u, fd[count], URING_DEPTH);
+                sqe->opcode = IORING_OP_FADVISE;
+                sqe->off = 12;
+                sqe->len = 0;
+                sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+                hint = 1;
+            }
+        }
+
+        err = uring_wait(u, count + hint, res, URING_DEPTH);
+        for(k = 0; k < count + hint; k++)
+            close(fd[k]);
+        if(err != 0)
+            return total > 0 ? total : err;
+
+        for(k = 0; k < count; k++){
+            if(res[k] < 0)
+                return total > 0 ? total : res[k];
+            total += res[k];
+            if((size_t)res[k] < seg[i + k].size)
+                return total;
+        }
+    }
+    return total;
+}
+
+static int read_segs(chunk_seg_t *seg, int n, const char *ra){
+    int i, res, total = 0;
+
+    //serve the segments before the first chunk that fails verification
+    for(i = 0; verify_mode && i < n; i++){
+        if((res = verify_chunk(seg[i].id)) != 0){
+            if(i == 0)
+                return res;
+            n = i;
+            ra = NULL;
+        }
+    }
+
+    if(use_uring && !mmap_chunks && (res = uring_read_segs(seg, n, ra)) != -ENOSYS)
+        return res;
+
+    for(i = 0; i < n; i++){
+        res = read_chunk(seg[i].id, seg[i].buf, seg[i].size, seg[i].offset);
+        if(res < 0)
+            return total > 0 ? total : res;
+        total += res;
+        if((size_t)res < seg[i].size)
+            break;
+    }
+    return total;
+}
+
+//the chunk list of a file in any namespace, NULL when it has none
+static int getsha1_path(const char *path, char **list){
+    int i = 0, j;
+    char sha1_path[512];
+    char *p;
+    char tmp_path[512];
+    char tmp_name[512];
+    char dir_id[SHA1_LEN + 1];
+
+    *list = NULL;
+    if(strncmp(path, "/.asof/", 7) == 0){
+        return getsha1_asof(path, list);
+    }
+
+    else if(strstr(path, "/.history/") != NULL){
+        strcpy(tmp_name, path);
+        getname_hist(tmp_name);
+        p = strrchr(path, '/');
+        j = p - path;
+        strncpy(tmp_path, path, j);
+        tmp_path[j] = '\0';
+        getsha1_dir(tmp_path, dir_id);
+        strcpy(sha1_path, data_path);
+        strcat(sha1_path, dir_id);
+        get_fs_head(sha1_path);
+
+        while(i < num){
+            if(strcmp(tmp_name, fs_head_name(head[i])) == 0){
+            return setsha1(list, fs_head_sha1(head[i]), fs_head_sha1_size(head[i]));
+            }
+        i++;
+        }
+    }
+
+    else if(strstr(path, "/.deleted/") != NULL){
+        strcpy(tmp_path, path);
+        getname_hist(tmp_path);
+        return getsha1_del(tmp_path, list);
+    }
+
+    else {
+        return getsha1_head(path, list);
+    }
+    return 0;
+}
+
+//the chunk index of a file, NULL with *err 0 when it has no content
+static chunk_index_t *getindex_path(const char *path, int *err){
+    char *list;
+    chunk_index_t *idx = NULL;
+
+    if((*err = getsha1_path(path, &list)) == 0 && list != NULL && list[0] != '\0')
+        idx = chunk_index_get(list, err);
+    free(list);
+    return idx;
+}
+
+static int read_index(chunk_index_t *idx, char *buf, size_t size, off_t offset){
+    int i, j, n, err;
+    size_t res = 0;
+    chunk_seg_t *seg;
+    const char *ra;
+
+    if(size == 0 || offset >= idx->off[idx->n])
+        return 0;
+    if((off_t)size > idx->off[idx->n] - offset)
+        size = idx->off[idx->n] - offset;
+
+    //split the request into one segment per chunk it touches
+    i = chunk_index_find(idx, offset);
+    j = chunk_index_find(idx, offset + size - 1);
+    seg = (chunk_seg_t*)malloc((j - i + 1) * sizeof(chunk_seg_t));
+    for(n = 0; res < size; n++){
+        seg[n].id = idx->ids + i*SHA1_LEN;
+        seg[n].buf = buf + res;
+        seg[n].offset = offset - idx->off[i];
+        seg[n].size = idx->off[i + 1] - offset;
+        if(seg[n].size > size - res)
+            seg[n].size = size - res;
+        res = res + seg[n].size;
+        offset = offset + seg[n].size;
+        i = chunk_index_find(idx, offset);
+    }
+
+    //hint the next chunk once a read reaches the end of its last chunk
+    ra = NULL;
+    if(i < idx->n && offset == idx->off[i])
+        ra = idx->ids + i*SHA1_LEN;
+
+    err = read_segs(seg, n, ra);
+    free(seg);
+    return err;
+}
+
+/*
+ * a file opened read-only keeps the chunk index resolved at open in
+ * fi->fh, so its reads are only the binary search of chunk_index_find and
+ * see the content as of the open. a read without a handle (replay, a file
+ * with no content at open) resolves the list again.
+ */
+#define FH_READ  1
+#define FH_WRITE 2
+
+typedef struct rfile_t {
+    int            kind;        /* FH_READ                              */
+    chunk_index_t *idx;
+} rfile_t;
+
+static int fh_kind(struct fuse_file_info *fi){
+    return fi != NULL && fi->fh != 0 ? *(int*)(uintptr_t)fi->fh : 0;
+}
+
+static int lunafuse_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    int err;
+    chunk_index_t *idx;
+
+    if(fh_kind(fi) == FH_READ)
+        return read_index(((rfile_t*)(uintptr_t)fi->fh)->idx, buf, size, offset);
+
+    if((idx = getindex_path(path, &err)) == NULL)
+        return err;
+    err = read_index(idx, buf, size, offset);
+    chunk_index_put(idx);
+    return err;
+}
+
+static int lunafuse_open(const char *path, struct fuse_file_info *fi)
+{
+    int err;
+    rfile_t *r;
+    chunk_index_t *idx;
+
+	if ((fi->flags & 3) != O_RDONLY)
+		return -EACCES;
+
+    //errors are left for the read to report
+    if((idx = getindex_path(path, &err)) == NULL)
+        return 0;
+    r = (rfile_t*)malloc(sizeof(rfile_t));
+    r->kind = FH_READ;
+    r->idx = idx;
+    fi->fh = (uint64_t)(uintptr_t)r;
+	return 0;
+}
+
+static int lunafuse_release_read(struct fuse_file_info *fi)
+{
+    rfile_t *r = (rfile_t*)(uintptr_t)fi->fh;
+
+    chunk_index_put(r->idx);
+    free(r);
+    fi->fh = 0;
+    return 0;
+}
+
+
+/*
+ * user.luna.* attributes let backup tools compare files by content hash
+ * without reading them: sha1 identifies the chunk list of a file in 40
+ * hex digits (the chunk's own sha1 for a single chunk, else the sha1 of
+ * the concatenated list, so it fits any xattr buffer), chunks is the
+ * list's length and histid the hist row the entry comes from (the delete
+ * row for .deleted entries). directories only carry histid.
+ */
+static int getxattr_head(const char *path, char *type, int64_t *histid, char **list){
+    int rc, res = -ENODATA;
+    char *sql;
+    const char *tail;
+    sqlite3_stmt *stmt;
+
+    sql = sqlite3_mprintf(
+        "SELECT type, histid, sha1 FROM head WHERE name=%Q AND status='o'", path);
+    rc = sqlite3_prepare(db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(db));
+        return -EIO;
+    }
+
+    rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW){
+        *type = *sqlite3_column_text(stmt, 0);
+        *histid = sqlite3_column_int64(stmt, 1);
+        res = setsha1(list, (const char*)sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+    }
+
+    sqlite3_finalize(stmt);
+    return res;
+}
+
+//entry of a .history snapshot, taken from the 'd' object of its parent
+static int getxattr_hist(const char *path, char *type, int64_t *histid, char **list){
+    int i, j;
+    char *p;
+    char tmp_path[512];
+    char tmp_name[512];
+    char sha1_path[512];
+    char dir_id[SHA1_LEN + 1];
+
+    strcpy(tmp_name, path);
+    getname_hist(tmp_name);
+    p = strrchr(path, '/');
+    j = p - path;
+    strncpy(tmp_path, path, j);
+    tmp_path[j] = '\0';
+    getsha1_dir(tmp_path, dir_id);
+    if(strlen(dir_id) == 0)
+        return -ENODATA;
+    strcpy(sha1_path, data_path);
+    strcat(sha1_path, dir_id);
+    num = 0;
+    get_fs_head(sha1_path);
+
+    for(i = 0; i < num; i++){
+        if(strcmp(tmp_name, fs_head_name(head[i])) == 0){
+            *type = head[i]->type;
+            *histid = head[i]->histid;
+            return setsha1(list, fs_head_sha1(head[i]), fs_head_sha1_size(head[i]));
+        }
+    }
+    return -ENODATA;
+}
+
+static int getxattr_asof(const char *path, char *type, int64_t *histid, char **list){
+    int i, found, res = -ENODATA;
+    char rest[512];
+    asof_view_t *v;
+
+    if((v = asof_open(path, rest, sizeof(rest))) == NULL)
+        return -ENODATA;
+    i = asof_find(v, rest, &found);
+    if(found){
+        *type = v->entry[i].type;
+        *histid = v->entry[i].histid;
+        res = setsha1(list, v->entry[i].sha1, strlen(v->entry[i].sha1));
+    }
+    pthread_mutex_unlock(&box_cur->asof_lock);
+    return res;
+}
+
+//type, histid and chunk list (the caller frees it) of any visible entry
+static int getinfo_xattr(const char *path, char *type, int64_t *histid, char **list){
+    char tmp_path[512];
+
+    *list = NULL;
+    if(strncmp(path, "/.asof/", 7) == 0){
+        return getxattr_asof(path, type, histid, list);
+    }
+    else if(strstr(path, "/.history/") != NULL){
+        return getxattr_hist(path, type, histid, list);
+    }
+    else if(strstr(path, "/.deleted/") != NULL){
+        strcpy(tmp_path, path);
+        getname_hist(tmp_path);
+        if((*histid = getid_del(tmp_path)) == 0)
+            return -ENODATA;
+        *type = 'f';
+        return getsha1_del(tmp_path, list);
+    }
+    return getxattr_head(path, type, histid, list);
+}
+
+static int lunafuse_getxattr(const char *path, const char *attr, char *value, size_t size)
+{
+    int i, res, len;
+    char type = 0;
+    int64_t histid = 0;
+    char num_s[SHA1_LEN + 1];
+    unsigned char md[20];
+    char *list;
+    const char *val;
+
+    if(strncmp(attr, "user.luna.", 10) != 0)
+        return -ENODATA;
+    if((res = getinfo_xattr(path, &type, &histid, &list)) != 0){
+        free(list);
+        return res;
+    }
+    if(list == NULL)
+        list = strdup("");
+
+    res = 0;
+    if(strcmp(attr, "user.luna.histid") == 0){
+        sprintf(num_s, "%lld", (long long)histid);
+        val = num_s;
+    }
+    else if(type != 'f'){
+        res = -ENODATA;
+    }
+    else if(strcmp(attr, "user.luna.sha1") == 0){
+        val = list;
+        if(strlen(list) > SHA1_LEN){
+            sha1_digest((const unsigned char*)list, strlen(list), md);
+            for(i = 0; i < 20; i++)
+                sprintf(num_s + 2*i, "%02x", md[i]);
+            val = num_s;
+        }
+    }
+    else if(strcmp(attr, "user.luna.chunks") == 0){
+        sprintf(num_s, "%d", (int)(strlen(list) / SHA1_LEN));
+        val = num_s;
+    }
+    else res = -ENODATA;
+
+    if(res == 0){
+        len = strlen(val);
+        if(size == 0)
+            res = len;
+        else if(size < (size_t)len)
+            res = -ERANGE;
+        else{
+            memcpy(value, val, len);
+            res = len;
+        }
+    }
+    free(list);
+    return res;
+}
+
+static int lunafuse_listxattr(const char *path, char *list, size_t size)
+{
+    int res, len;
+    char type = 0;
+    int64_t histid = 0;
+    char *ids;
+    const char *names;
+
+    res = getinfo_xattr(path, &type, &histid, &ids);
+    free(ids);
+    if(res != 0)
+        return 0;
+    if(type == 'f'){
+        names = "user.luna.sha1\0user.luna.histid\0user.luna.chunks";
+        len = sizeof("user.luna.sha1\0user.luna.histid\0user.luna.chunks");
+    }else{
+        names = "user.luna.histid";
+        len = sizeof("user.luna.histid");
+    }
+
+    if(size == 0)
+        return len;
+    if(size < (size_t)len)
+        return -ERANGE;
+    memcpy(list, names, len);
+    return len;
+}
+
+/*
+ * with -o rw files can be written. a file opened for writing is held in
+ * memory and, on flush/release, cut into SHA1_MAX chunks stored in the
+ * usual object format; chunks whose object already exists are not written
+ * again. the head update and its hist row go into a per-box transaction
+ * that is committed every WRITE_BATCH changes, after WRITE_BATCH_MS, on
+ * fsync and at unmount; a commit that fails is retried, and changes that
+ * sqlite rolled back are reported by the next flush or fsync. every hist
+ * row bumps this box's counter in the row's vclock, as the sync client
+ * does. a rename is recorded as a 'd' of each old name and an 'a' of the
+ * new one, or as an 'm' of the target when a file replaces a file.
+ */
+typedef struct wfile_t {
+    int       kind;             /* FH_WRITE                             */
+    char      path[512];        /* path inside the box                  */
+    box_t    *box;
+    char     *data;
+    size_t    len;
+    size_t    cap;
+    int       dirty;
+    char      op;               /* hist op of the next commit: 'a', 'm' */
+    struct wfile_t *next;       /* in box->wopen                        */
+} wfile_t;
+
+static int write_enabled = 0;
+static int write_stop = 0;
+static pthread_t write_thread;
+
+static wfile_t *wfile_of(struct fuse_file_info *fi){
+    return fh_kind(fi) == FH_WRITE ? (wfile_t*)(uintptr_t)fi->fh : NULL;
+}
+
+static uint64_t write_now_ms(void){
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+//windows FILETIME, the unit of ctime/mtime in head and hist
+static int64_t write_filetime(void){
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (int64_t)t.tv_sec * 10000000 + t.tv_nsec / 100 + 116444736000000000LL;
+}
+
+static int write_parent(const char *path){
+    char parent[512];
+    struct stat st;
+    const char *p = strrchr(path, '/');
+
+    if(p == path)
+        return 0;
+    snprintf(parent, sizeof(parent), "%.*s", (int)(p - path), path);
+    if(lunafuse_getattr(parent, &st) != 0)
+        return -ENOENT;
+    return S_ISDIR(st.st_mode) ? 0 : -ENOTDIR;
+}
+
+static int write_virtual(const char *path){
+    return strncmp(path, "/.asof", 6) == 0 || strstr(path, "/.history") != NULL
+        || strstr(path, "/.deleted") != NULL;
+}
+
+//runs and frees sql, with the box's write_lock held
+static int write_sql(box_t *b, char *sql){
+    char *err = NULL;
+    int rc = sqlite3_exec(b->db, sql, NULL, NULL, &err);
+
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", err);
+        sqlite3_free(err);
+    }
+    sqlite3_free(sql);
+    return rc == SQLITE_OK ? 0 : -EIO;
+}
+
+//the open transaction is gone and its changes with it
+static void write_lost(box_t *b){
+    fprintf(stderr, "box %s: %d changes lost\n", b->name, b->txn_ops);
+    b->txn_ops = 0;
+    b->txn_err = -EIO;
+}
+
+//on failure the transaction stays open for a retry unless sqlite ended it
+static int write_commit(box_t *b){
+    if(b->txn_ops == 0)
+        return 0;
+    if(sqlite3_exec(b->db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK){
+        b->txn_ops = 0;
+        return 0;
+    }
+    fprintf(stderr, "commit failed:%s\n", sqlite3_errmsg(b->db));
+    if(sqlite3_get_autocommit(b->db))
+        write_lost(b);
+    return -EIO;
+}
+
+//the error of changes lost since the last call
+static int write_error(box_t *b){
+    int res;
+
+    pthread_mutex_lock(&b->write_lock);
+    res = b->txn_err;
+    b->txn_err = 0;
+    pthread_mutex_unlock(&b->write_lock);
+    return res;
+}
+
+//every change is one or more hist rows plus their head updates, counted
+//towards the batch; a change that fails is rolled back alone
+static int write_txn_begin(box_t *b){
+    if(b->txn_ops > 0 && sqlite3_get_autocommit(b->db))
+        write_lost(b);
+    if(b->txn_ops == 0){
+        if(write_sql(b, sqlite3_mprintf("BEGIN")) != 0)
+            return -EIO;
+        b->txn_start = write_now_ms();
+    }
+    if(write_sql(b, sqlite3_mprintf("SAVEPOINT change")) != 0){
+        if(b->txn_ops == 0)
+            write_sql(b, sqlite3_mprintf("ROLLBACK"));
+        return -EIO;
+    }
+    return 0;
+}
+
+static void write_txn_end(box_t *b, int res){
+    if(res != 0)
+        write_sql(b, sqlite3_mprintf("ROLLBACK TO change"));
+    write_sql(b, sqlite3_mprintf("RELEASE change"));
+    b->txn_ops++;
+    if(b->txn_ops >= WRITE_BATCH)
+        write_commit(b);
+}
+
+static void *write_committer(void *arg){
+    int i;
+    struct timespec t = {0, 100000000};
+    (void) arg;
+
+    while(!__atomic_load_n(&write_stop, __ATOMIC_ACQUIRE)){
+        nanosleep(&t, NULL);
+        for(i = 0; i < nbox; i++){
+            pthread_mutex_lock(&box[i].write_lock);
+            if(box[i].txn_ops > 0 && write_now_ms() - box[i].txn_start >= WRITE_BATCH_MS)
+                write_commit(&box[i]);
+            pthread_mutex_unlock(&box[i].write_lock);
+        }
+    }
+    return NULL;
+}
+
+//store one object unless it exists already, id gets its sha1
+static int write_object(char type, const char *payload, size_t len, char *id){
+    int i, fd, res = 0;
+    unsigned char md[20];
+    char sha1_path[512];
+    char tmp_path[sizeof(data_path) + SHA1_LEN + 32];
+    unsigned char *obj;
+
+    if((obj = (unsigned char*)malloc(len + 12)) == NULL)
+        return -ENOMEM;
+    memset(obj, 0, 12);
+    obj[0] = type;
+    obj[3] = 0xee;
+    *(int32_t*)(obj + 4) = len;
+    memcpy(obj + 12, payload, len);
+    sha1_digest(obj, len + 12, md);
+    for(i = 0; i < 20; i++)
+        sprintf(id + 2*i, "%02x", md[i]);
+
+    strcpy(sha1_path, data_path);
+    strcat(sha1_path, id);
+    if(access(sha1_path, F_OK) == 0){
+        free(obj);
+        return 0;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%s.%ld", data_path, id, (long)syscall(SYS_gettid));
+    if((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1){
+        free(obj);
+        return -errno;
+    }
+    if(write(fd, obj, len + 12) != (ssize_t)(len + 12) || fsync(fd) != 0)
+        res = -EIO;
+    close(fd);
+    if(res == 0 && rename(tmp_path, sha1_path) != 0)
+        res = -errno;
+    if(res != 0)
+        unlink(tmp_path);
+    free(obj);
+    return res;
+}
+
+/*
+ * a vclock is a list of 41-byte entries: a 36-byte box uuid, '\0' and a
+ * little-endian 32-bit counter. vclock_hex renders one for an X'' literal.
+ */
+#define VCLOCK_ENTRY 41
+
+static char *vclock_hex(const unsigned char *clk, int len){
+    int i;
+    char *hex = (char*)malloc(2 * len + 1);
+
+    for(i = 0; i < len; i++)
+        sprintf(hex + 2*i, "%02X", clk[i]);
+    hex[2 * len] = '\0';
+    return hex;
+}
+
+//this box's entry at counter
+static void vclock_entry(box_t *b, unsigned char *e, uint32_t counter){
+    memset(e, 0, VCLOCK_ENTRY);
+    memcpy(e, b->uuid, strlen(b->uuid) < 36 ? strlen(b->uuid) : 36);
+    e[37] = counter & 0xff;
+    e[38] = (counter >> 8) & 0xff;
+    e[39] = (counter >> 16) & 0xff;
+    e[40] = (counter >> 24) & 0xff;
+}
+
+//the live row's vclock with this box's counter bumped, as hex
+static char *write_vclock(box_t *b, const char *path){
+    int rc, i, len = 0;
+    char *sql, *hex;
+    const char *tail;
+    unsigned char *clk;
+    unsigned char e[VCLOCK_ENTRY];
+    uint32_t counter;
+    sqlite3_stmt *stmt;
+
+    sql = sqlite3_mprintf("SELECT vclock FROM head WHERE name=%Q AND status='o'", path);
+    rc = sqlite3_prepare(b->db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(b->db));
+        return NULL;
+    }
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+        len = sqlite3_column_bytes(stmt, 0) / VCLOCK_ENTRY * VCLOCK_ENTRY;
+    clk = (unsigned char*)malloc(len + VCLOCK_ENTRY);
+    if(len > 0)
+        memcpy(clk, sqlite3_column_blob(stmt, 0), len);
+    sqlite3_finalize(stmt);
+
+    vclock_entry(b, e, 0);
+    for(i = 0; i < len && memcmp(clk + i, e, 37) != 0; i += VCLOCK_ENTRY)
+        ;
+    if(i == len){
+        memcpy(clk + len, e, VCLOCK_ENTRY);
+        len += VCLOCK_ENTRY;
+    }
+    counter = clk[i+37] | clk[i+38] << 8 | clk[i+39] << 16 | (uint32_t)clk[i+40] << 24;
+    vclock_entry(b, clk + i, counter + 1);
+    hex = vclock_hex(clk, len);
+    free(clk);
+    return hex;
+}
+
+//record the live row of path as a hist row with op; 'd' also retires the row
+static int write_hist(box_t *b, const char *path, char op){
+    int res;
+    char *hex;
+
+    res = write_sql(b, sqlite3_mprintf(
+        "INSERT INTO hist(hid, op, name, type, ctime, mtime, size, mode, sha1,\
+        boxid, uid, timestamp) SELECT id, '%c', name, type, ctime, mtime, size,\
+        mode, sha1, %Q, %d, %lld FROM head WHERE name=%Q AND status='o'",
+        op, b->uuid, b->uid, (long long)time(NULL), path));
+    if(res == 0 && sqlite3_changes(b->db) == 0)
+        return -ENOENT;
+    if(res != 0 || (hex = write_vclock(b, path)) == NULL)
+        return -EIO;
+    res = write_sql(b, sqlite3_mprintf(
+        "UPDATE head SET histid=%lld, vclock=X'%s'%s WHERE name=%Q AND status='o'",
+        sqlite3_last_insert_rowid(b->db), hex, op == 'd' ? ", status='d'" : "", path));
+    free(hex);
+    return res;
+}
+
+/*
+ * make path a live row, reusing the row of a deleted entry. its values
+ * come from the live row of src when given, else from the arguments; a
+ * new row starts with this box's vclock entry at 0, so its first hist
+ * row takes it to 1.
+ */
+static int write_put(box_t *b, const char *path, const char *src,
+        char type, int mode, const char *id){
+    int res;
+    char *hex;
+    unsigned char e[VCLOCK_ENTRY];
+    int64_t ft = write_filetime();
+
+    if(src != NULL)
+        res = write_sql(b, sqlite3_mprintf(
+            "UPDATE head SET (type, ctime, mtime, size, mode, sha1, status) =\
+            (SELECT type, ctime, mtime, size, mode, sha1, 'o' FROM head\
+            WHERE name=%Q AND status='o') WHERE name=%Q", src, path));
+    else
+        res = write_sql(b, sqlite3_mprintf(
+            "UPDATE head SET type='%c', ctime=%lld, mtime=%lld, size=0, status='o',\
+            mode=%d, sha1=%Q WHERE name=%Q", type, ft, ft, mode, id, path));
+    if(res != 0 || sqlite3_changes(b->db) > 0)
+        return res;
+
+    vclock_entry(b, e, 0);
+    hex = vclock_hex(e, VCLOCK_ENTRY);
+    if(src != NULL)
+        res = write_sql(b, sqlite3_mprintf(
+            "INSERT INTO head(pid, name, type, ctime, mtime, histid, size, vclock,\
+            status, mode, sha1) SELECT 0, %Q, type, ctime, mtime, 0, size, X'%s',\
+            'o', mode, sha1 FROM head WHERE name=%Q AND status='o'", path, hex, src));
+    else
+        res = write_sql(b, sqlite3_mprintf(
+            "INSERT INTO head(pid, name, type, ctime, mtime, histid, size, vclock,\
+            status, mode, sha1) VALUES(0, %Q, '%c', %lld, %lld, 0, 0, X'%s', 'o', %d, %Q)",
+            path, type, ft, ft, hex, mode, id));
+    free(hex);
+    return res;
+}
+
+static int write_file(wfile_t *w){
+    int res = 0;
+    size_t off = 0, n;
+    int64_t ft = write_filetime();
+    char *ids;
+    box_t *b = w->box;
+
+    if(w->len > WRITE_MAX)
+        return -EFBIG;
+    //an empty file still has its one empty chunk
+    if((ids = (char*)malloc((w->len / SHA1_MAX + 1) * SHA1_LEN + 1)) == NULL)
+        return -ENOMEM;
+    ids[0] = '\0';
+    do{
+        n = w->len - off > SHA1_MAX ? SHA1_MAX : w->len - off;
+        if((res = write_object('b', w->data + off, n, ids + off / SHA1_MAX * SHA1_LEN)) != 0){
+            free(ids);
+            return res;
+        }
+        off += n;
+    }while(off < w->len);
+
+    pthread_mutex_lock(&b->write_lock);
+    if((res = write_txn_begin(b)) == 0){
+        res = write_sql(b, sqlite3_mprintf(
+            "UPDATE head SET mtime=%lld, size=%lld, sha1=%Q WHERE name=%Q AND status='o'",
+            ft, (long long)w->len, ids, w->path));
+        if(res == 0 && sqlite3_changes(b->db) == 0)
+            res = -ENOENT;
+        if(res == 0)
+            res = write_hist(b, w->path, w->op);
+        write_txn_end(b, res);
+    }
+    pthread_mutex_unlock(&b->write_lock);
+    free(ids);
+
+    if(res == 0){
+        w->dirty = 0;
+        w->op = 'm';
+    }
+    return res;
+}
+
+//new entry; a file gets its 'a' hist row with its first content, a directory right away
+static int write_add(const char *path, char type, int mode, const char *id){
+    int res;
+    box_t *b = box_cur;
+
+    pthread_mutex_lock(&b->write_lock);
+    if((res = write_txn_begin(b)) == 0){
+        res = write_put(b, path, NULL, type, mode, id);
+        if(res == 0 && type == 'd')
+            res = write_hist(b, path, 'a');
+        write_txn_end(b, res);
+    }
+    pthread_mutex_unlock(&b->write_lock);
+    return res;
+}
+
+//mark the entry deleted and record the 'd' row .deleted is built from
+static int write_del(const char *path){
+    int res;
+    box_t *b = box_cur;
+
+    pthread_mutex_lock(&b->write_lock);
+    if((res = write_txn_begin(b)) == 0){
+        res = write_hist(b, path, 'd');
+        write_txn_end(b, res);
+    }
+    pthread_mutex_unlock(&b->write_lock);
+    return res;
+}
+
+//live names at or below path, in name order so parents come first
+static char **write_subtree(box_t *b, const char *path, int *count){
+    int rc, n = 0, cap = 16;
+    char *sql;
+    const char *tail;
+    char **names;
+    char prefix[1024];
+    sqlite3_stmt *stmt;
+
+    snprintf(prefix, sizeof(prefix), "%s/", path);
+    sql = sqlite3_mprintf("SELECT name FROM head WHERE status='o' AND\
+            (name=%Q OR substr(name, 1, %d)=%Q) ORDER BY name",
+            path, (int)strlen(prefix), prefix);
+    rc = sqlite3_prepare(b->db, sql, (int)strlen(sql), &stmt, &tail);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(b->db));
+        return NULL;
+    }
+    names = (char**)malloc(cap * sizeof(char*));
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        if(n == cap){
+            cap *= 2;
+            names = (char**)realloc(names, cap * sizeof(char*));
+        }
+        names[n++] = strdup((const char*)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    *count = n;
+    return names;
+}
+
+static int write_rename(box_t *b, const char *from, const char *to, int replace){
+    int i, n = 0, res = 0, len = strlen(from);
+    char **names;
+    char name[512];
+    wfile_t *w;
+
+    //a file over a file continues the target's history
+    if(replace == 'f'){
+        res = write_sql(b, sqlite3_mprintf(
+            "UPDATE head SET (mtime, size, mode, sha1) = (SELECT mtime, size, mode, sha1\
+            FROM head WHERE name=%Q AND status='o') WHERE name=%Q AND status='o'", from, to));
+        if(res == 0)
+            res = write_hist(b, to, 'm');
+        if(res == 0)
+            res = write_hist(b, from, 'd');
+    }else{
+        if(replace == 'd')
+            res = write_hist(b, to, 'd');
+        if(res == 0 && (names = write_subtree(b, from, &n)) == NULL)
+            res = -EIO;
+        for(i = 0; i < n; i++){
+            if(snprintf(name, sizeof(name), "%s%s", to, names[i] + len) >= (int)sizeof(name))
+                res = -ENAMETOOLONG;
+            if(res == 0)
+                res = write_put(b, name, names[i], 0, 0, NULL);
+            if(res == 0)
+                res = write_hist(b, name, 'a');
+            if(res == 0)
+                res = write_hist(b, names[i], 'd');
+            free(names[i]);
+        }
+        if(n > 0)
+            free(names);
+    }
+    if(res != 0)
+        return res;
+
+    //handles open below from now commit to the new name
+    for(w = b->wopen; w != NULL; w = w->next){
+        if(strncmp(w->path, from, len) == 0 && (w->path[len] == '\0' || w->path[len] == '/') &&
+                snprintf(name, sizeof(name), "%s%s", to, w->path + len) < (int)sizeof(name)){
+            strcpy(w->path, name);
+            w->op = 'm';
+        }
+    }
+    return 0;
+}
+
+static void wfile_link(wfile_t *w){
+    pthread_mutex_lock(&w->box->write_lock);
+    w->next = w->box->wopen;
+    w->box->wopen = w;
+    pthread_mutex_unlock(&w->box->write_lock);
+}
+
+static void wfile_unlink(wfile_t *w){
+    wfile_t **p;
+
+    pthread_mutex_lock(&w->box->write_lock);
+    for(p = &w->box->wopen; *p != NULL && *p != w; p = &(*p)->next)
+        ;
+    if(*p != NULL)
+        *p = w->next;
+    pthread_mutex_unlock(&w->box->write_lock);
+}
+
+//new hist rows carry the boxid and uid of the latest change, snapshot rows have none
+static int write_setup(box_t *b){
+    int rc;
+    char *sql;
+    const char *tail;
+    sqlite3_stmt *stmt;
+
+    pthread_mutex_init(&b->write_lock, NULL);
+    sqlite3_busy_timeout(b->db, WRITE_BUSY_MS);
+    sqlite3_exec(b->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sql = "SELECT boxid, uid FROM hist WHERE op != 's' ORDER BY id DESC LIMIT 1";
+    rc = sqlite3_prepare(b->db, sql, (int)strlen(sql), &stmt, &tail);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(b->db));
+        return -1;
+    }
+    if(sqlite3_step(stmt) == SQLITE_ROW){
+        if(sqlite3_column_text(stmt, 0) != NULL)
+            snprintf(b->uuid, sizeof(b->uuid), "%s", (const char*)sqlite3_column_text(stmt, 0));
+        b->uid = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static void write_begin(void){
+    if(pthread_create(&write_thread, NULL, write_committer, NULL) != 0)
+        write_thread = 0;
+}
+
+static void write_end(void){
+    int i;
+
+    __atomic_store_n(&write_stop, 1, __ATOMIC_RELEASE);
+    if(write_thread != 0)
+        pthread_join(write_thread, NULL);
+    //a box that still cannot commit is rolled back before its db is closed
+    for(i = 0; i < nbox; i++){
+        pthread_mutex_lock(&box[i].write_lock);
+        if(write_commit(&box[i]) != 0 && write_commit(&box[i]) != 0 && box[i].txn_ops > 0){
+            sqlite3_exec(box[i].db, "ROLLBACK", NULL, NULL, NULL);
+            write_lost(&box[i]);
+        }
+        pthread_mutex_unlock(&box[i].write_lock);
+    }
+}
+
+static int lunafuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int res, exists;
+    char id[SHA1_LEN + 1];
+    wfile_t *w;
+    struct stat st;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if((res = write_parent(path)) != 0)
+        return res;
+    if((exists = lunafuse_getattr(path, &st) == 0) && S_ISDIR(st.st_mode))
+        return -EISDIR;
+    if((res = write_object('b', NULL, 0, id)) != 0)
+        return res;
+    if((res = write_add(path, 'f', mode & 0777, id)) != 0)
+        return res;
+
+    if((w = (wfile_t*)calloc(1, sizeof(wfile_t))) == NULL)
+        return -ENOMEM;
+    w->kind = FH_WRITE;
+    strcpy(w->path, path);
+    w->box = box_cur;
+    w->dirty = 1;
+    w->op = exists ? 'm' : 'a';
+    wfile_link(w);
+    fi->fh = (uint64_t)(uintptr_t)w;
+    return 0;
+}
+
+//a file opened for writing, with its current content unless trunc
+static int wfile_open(const char *path, int trunc, wfile_t **out){
+    int res;
+    wfile_t *w;
+    struct stat st;
+    chunk_index_t *idx = NULL;
+
+    if((res = lunafuse_getattr(path, &st)) != 0)
+        return res;
+    if(S_ISDIR(st.st_mode))
+        return -EISDIR;
+    if(!trunc && (idx = getindex_path(path, &res)) == NULL && res != 0)
+        return res;
+
+    w = (wfile_t*)calloc(1, sizeof(wfile_t));
+    if(w == NULL || (idx != NULL && (w->data = (char*)malloc(idx->off[idx->n] + 1)) == NULL)){
+        free(w);
+        chunk_index_put(idx);
+        return -ENOMEM;
+    }
+    w->kind = FH_WRITE;
+    strcpy(w->path, path);
+    w->box = box_cur;
+    w->op = 'm';
+    if(idx != NULL){
+        w->cap = idx->off[idx->n];
+        while(w->len < w->cap){
+            if((res = read_index(idx, w->data + w->len, SHA1_MAX, w->len)) <= 0)
+                break;
+            w->len += res;
+        }
+        chunk_index_put(idx);
+        if(res < 0){
+            free(w->data);
+            free(w);
+            return res;
+        }
+    }
+    w->dirty = trunc;
+    *out = w;
+    return 0;
+}
+
+static int lunafuse_open_write(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+    wfile_t *w;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if((res = wfile_open(path, fi->flags & O_TRUNC, &w)) != 0)
+        return res;
+    wfile_link(w);
+    fi->fh = (uint64_t)(uintptr_t)w;
+    return 0;
+}
+
+//reads on a handle opened for writing see its unflushed content
+static int wfile_read(wfile_t *w, char *buf, size_t size, off_t offset){
+    if((size_t)offset >= w->len)
+        return 0;
+    if(size > w->len - offset)
+        size = w->len - offset;
+    memcpy(buf, w->data + offset, size);
+    return size;
+}
+
+//room for len bytes, doubling up to WRITE_MAX; a file past it could not be stored
+static int wfile_grow(wfile_t *w, size_t len){
+    size_t cap;
+    char *data;
+
+    if(len > WRITE_MAX)
+        return -EFBIG;
+    if(len <= w->cap)
+        return 0;
+    cap = len > WRITE_MAX / 2 ? WRITE_MAX : len * 2;
+    if((data = (char*)realloc(w->data, cap)) == NULL &&
+            (data = (char*)realloc(w->data, cap = len)) == NULL)
+        return -ENOMEM;
+    w->data = data;
+    w->cap = cap;
+    return 0;
+}
 
-        while(i < num){
-            if(strcmp(tmp_name, fs_head_name(head[i])) == 0){
-            strncpy(sha1, fs_head_sha1(head[i]), fs_head_sha1_size(head[i])); 
-            sha1[fs_head_sha1_size(head[i])] = '\0';
-            break;
-            }
-        i++;
+static int lunafuse_write(const char *path, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    int res;
+    wfile_t *w = wfile_of(fi);
+    (void) path;
+
+    if(w == NULL)
+        return -EBADF;
+    if(offset < 0)
+        return -EINVAL;
+    if((size_t)offset > WRITE_MAX)
+        return -EFBIG;
+    if((res = wfile_grow(w, offset + size)) != 0)
+        return res;
+    if((size_t)offset > w->len)
+        memset(w->data + w->len, 0, offset - w->len);
+    memcpy(w->data + offset, buf, size);
+    if(offset + size > w->len)
+        w->len = offset + size;
+    w->dirty = 1;
+    return size;
+}
+
+static int wfile_resize(wfile_t *w, off_t size){
+    char *data;
+
+    if(size < 0)
+        return -EINVAL;
+    if((size_t)size > WRITE_MAX)
+        return -EFBIG;
+    if((size_t)size > w->cap){
+        if((data = (char*)realloc(w->data, size)) == NULL)
+            return -ENOMEM;
+        w->data = data;
+        w->cap = size;
+    }
+    if((size_t)size > w->len)
+        memset(w->data + w->len, 0, size - w->len);
+    w->len = size;
+    w->dirty = 1;
+    return 0;
+}
+
+static int lunafuse_truncate(const char *path, off_t size)
+{
+    int res;
+    wfile_t *w;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if((res = wfile_open(path, size == 0, &w)) != 0)
+        return res;
+    if((res = wfile_resize(w, size)) == 0)
+        res = write_file(w);
+    free(w->data);
+    free(w);
+    return res;
+}
+
+static int lunafuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    wfile_t *w = wfile_of(fi);
+
+    if(w == NULL)
+        return lunafuse_truncate(path, size);
+    return wfile_resize(w, size);
+}
+
+static int lunafuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    int res = 0;
+    wfile_t *w = wfile_of(fi);
+    (void) path;
+
+    if(w == NULL)
+        return 0;
+    if(w->dirty)
+        res = write_file(w);
+    if(res == 0)
+        res = write_error(w->box);
+    return res;
+}
+
+static int lunafuse_release(const char *path, struct fuse_file_info *fi)
+{
+    wfile_t *w = wfile_of(fi);
+    (void) path;
+
+    if(fh_kind(fi) == FH_READ)
+        return lunafuse_release_read(fi);
+    if(w == NULL)
+        return 0;
+    if(w->dirty)
+        write_file(w);
+    wfile_unlink(w);
+    free(w->data);
+    free(w);
+    fi->fh = 0;
+    return 0;
+}
+
+static int lunafuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int res = 0;
+    wfile_t *w = wfile_of(fi);
+    (void) path;
+    (void) datasync;
+
+    if(w != NULL && w->dirty)
+        res = write_file(w);
+    pthread_mutex_lock(&box_cur->write_lock);
+    if(write_commit(box_cur) != 0 && res == 0)
+        res = -EIO;
+    pthread_mutex_unlock(&box_cur->write_lock);
+    if(res == 0)
+        res = write_error(box_cur);
+    return res;
+}
+
+static int lunafuse_mkdir(const char *path, mode_t mode)
+{
+    int res;
+    char id[SHA1_LEN + 1];
+    struct stat st;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if(lunafuse_getattr(path, &st) == 0)
+        return -EEXIST;
+    if((res = write_parent(path)) != 0)
+        return res;
+    if((res = write_object('d', NULL, 0, id)) != 0)
+        return res;
+    return write_add(path, 'd', mode & 0777, id);
+}
+
+static int lunafuse_unlink(const char *path)
+{
+    struct stat st;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if(lunafuse_getattr(path, &st) != 0)
+        return -ENOENT;
+    if(S_ISDIR(st.st_mode))
+        return -EISDIR;
+    return write_del(path);
+}
+
+static int lunafuse_rmdir(const char *path)
+{
+    struct stat st;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    if(strcmp(path, "/") == 0)
+        return -EBUSY;
+    if(lunafuse_getattr(path, &st) != 0)
+        return -ENOENT;
+    if(!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+    getname_head(path);
+    if(num > 0)
+        return -ENOTEMPTY;
+    return write_del(path);
+}
+
+static int lunafuse_rename(const char *from, const char *to)
+{
+    int res, len = strlen(from);
+    char replace = 0;
+    struct stat st, st_to;
+    box_t *b = box_cur;
+
+    if(!write_enabled || write_virtual(from) || write_virtual(to))
+        return -EROFS;
+    if(strcmp(from, "/") == 0 || strcmp(to, "/") == 0)
+        return -EBUSY;
+    if(lunafuse_getattr(from, &st) != 0)
+        return -ENOENT;
+    if(strcmp(from, to) == 0)
+        return 0;
+    if(strncmp(to, from, len) == 0 && to[len] == '/')
+        return -EINVAL;
+    if((res = write_parent(to)) != 0)
+        return res;
+    if(lunafuse_getattr(to, &st_to) == 0){
+        if(S_ISDIR(st_to.st_mode) && !S_ISDIR(st.st_mode))
+            return -EISDIR;
+        if(!S_ISDIR(st_to.st_mode) && S_ISDIR(st.st_mode))
+            return -ENOTDIR;
+        if(S_ISDIR(st_to.st_mode)){
+            getname_head(to);
+            if(num > 0)
+                return -ENOTEMPTY;
         }
+        replace = S_ISDIR(st_to.st_mode) ? 'd' : 'f';
     }
 
-    else if(strstr(path, "/.deleted/") != NULL){
-        strcpy(tmp_path, path);
-        getname_hist(tmp_path);
-        getsha1_del(tmp_path);
+    pthread_mutex_lock(&b->write_lock);
+    if((res = write_txn_begin(b)) == 0){
+        res = write_rename(b, from, to, replace);
+        write_txn_end(b, res);
     }
+    pthread_mutex_unlock(&b->write_lock);
+    return res;
+}
 
-    else {
-        getsha1_head(path);
+//mtime is not reported by getattr, so setting times is accepted and ignored
+static int lunafuse_utimens(const char *path, const struct timespec tv[2])
+{
+    (void) tv;
+
+    if(!write_enabled || write_virtual(path))
+        return -EROFS;
+    return 0;
+}
+
+/*
+ * every call goes through the box layer: it records the trace, picks the
+ * box from the first path component when several are mounted and hands
+ * the rest of the path to the callbacks above.
+ */
+static const char *box_enter(const char *path){
+    int i, len;
+    const char *p;
+
+    if(!box_multi){
+        box_cur = &box[0];
+        db = box_cur->db;
+        return path;
     }
+    p = strchr(path + 1, '/');
+    len = p ? p - path - 1 : (int)strlen(path + 1);
+    for(i = 0; i < nbox; i++){
+        if((int)strlen(box[i].name) == len && strncmp(box[i].name, path + 1, len) == 0){
+            box_cur = &box[i];
+            db = box_cur->db;
+            return p ? p : "/";
+        }
+    }
+    return NULL;
+}
 
-    sha1_len = strlen(sha1); 
-    strcpy(sha1_path, data_path);
-    n = sha1_len/SHA1_LEN;
-    i = offset/SHA1_MAX;
-
-    while(n > i+1 && res != size){
-        in_offset = offset%SHA1_MAX + 12;
-        strncat(sha1_path, sha1+i*SHA1_LEN, SHA1_LEN);
-	    fd = open(sha1_path, O_RDONLY);
-	    if (fd == -1)
-	        return -errno;
-        in_res = pread(fd, buf + res, in_size, in_offset);
-	    if (res == -1)
-	        return -errno;
-        res = res + in_res; 
-        offset = offset + in_res;
-        in_size = in_size - in_res;
-        i = offset/SHA1_MAX;
-        close (fd);
+static int box_getattr(const char *path, struct stat *stbuf)
+{
+    if(trace_file != NULL)
+        trace_op(TRACE_GETATTR, path, 0, 0);
+
+    if(box_multi && strcmp(path, "/") == 0){
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFDIR | 493;
+        stbuf->st_nlink = 2;
+        return 0;
     }
-    
-    if(n == i+1 && res != size){
-        in_offset = offset%SHA1_MAX + 12;
-        strncat(sha1_path, sha1+i*SHA1_LEN, SHA1_LEN);
-	    fd = open(sha1_path, O_RDONLY);
-	    if (fd == -1)
-	        return -errno;
-        in_res = pread(fd, buf + res, in_size, in_offset);
-	    if (res == -1)
-	        return -errno;
-        res = res + in_res; 
-        close(fd);
+    if((path = box_enter(path)) == NULL)
+        return -ENOENT;
+    return lunafuse_getattr(path, stbuf);
+}
+
+static int box_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int i;
+
+    if(trace_file != NULL)
+        trace_op(TRACE_READDIR, path, 0, 0);
+
+    if(box_multi && strcmp(path, "/") == 0){
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for(i = 0; i < nbox; i++)
+            filler(buf, box[i].name, NULL, 0);
+        return 0;
+    }
+    if((path = box_enter(path)) == NULL)
+        return -ENOENT;
+    return lunafuse_readdir(path, buf, filler, offset, fi);
+}
+
+static int box_open(const char *path, struct fuse_file_info *fi)
+{
+    if(trace_file != NULL)
+        trace_op(TRACE_OPEN, path, 0, 0);
+
+    if((path = box_enter(path)) == NULL)
+        return -ENOENT;
+    if((fi->flags & 3) != O_RDONLY && write_enabled)
+        return lunafuse_open_write(path, fi);
+    return lunafuse_open(path, fi);
+}
+
+static int box_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    if(trace_file != NULL)
+        trace_op(TRACE_READ, path, offset, size);
+
+    if(fh_kind(fi) == FH_WRITE)
+        return wfile_read(wfile_of(fi), buf, size, offset);
+    if((path = box_enter(path)) == NULL)
+        return -ENOENT;
+    return lunafuse_read(path, buf, size, offset, fi);
+}
+
+static int box_getxattr(const char *path, const char *attr, char *value, size_t size)
+{
+    if((path = box_enter(path)) == NULL)
+        return -ENODATA;
+    return lunafuse_getxattr(path, attr, value, size);
+}
+
+static int box_listxattr(const char *path, char *list, size_t size)
+{
+    if((path = box_enter(path)) == NULL)
+        return 0;
+    return lunafuse_listxattr(path, list, size);
+}
+
+static int box_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_create(path, mode, fi);
+}
+
+static int box_write(const char *path, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    return lunafuse_write(path, buf, size, offset, fi);
+}
+
+static int box_truncate(const char *path, off_t size)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_truncate(path, size);
+}
+
+static int box_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_ftruncate(path, size, fi);
+}
+
+static int box_flush(const char *path, struct fuse_file_info *fi)
+{
+    return lunafuse_flush(path, fi);
+}
+
+static int box_release(const char *path, struct fuse_file_info *fi)
+{
+    if(trace_file != NULL && path != NULL && fh_kind(fi) != FH_WRITE)
+        trace_op(TRACE_RELEASE, path, 0, 0);
+
+    return lunafuse_release(path, fi);
+}
+
+static int box_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if((path = box_enter(path)) == NULL)
+        return -ENOENT;
+    return lunafuse_fsync(path, datasync, fi);
+}
+
+static int box_mkdir(const char *path, mode_t mode)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_mkdir(path, mode);
+}
+
+static int box_unlink(const char *path)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_unlink(path);
+}
+
+static int box_rmdir(const char *path)
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_rmdir(path);
+}
+
+static int box_rename(const char *from, const char *to)
+{
+    box_t *b;
+
+    if((from = box_enter(from)) == NULL)
+        return -ENOENT;
+    b = box_cur;
+    if((to = box_enter(to)) == NULL || box_cur != b)
+        return -EXDEV;
+    return lunafuse_rename(from, to);
+}
+
+static int box_utimens(const char *path, const struct timespec tv[2])
+{
+    if((path = box_enter(path)) == NULL)
+        return -EROFS;
+    return lunafuse_utimens(path, tv);
+}
+
+//a top-level directory must be reachable: unique and not "", "." or ".."
+static int box_name_ok(const char *name){
+    int i;
+
+    if(strlen(name) >= sizeof(box[0].name) || strchr(name, '/') != NULL)
+        return 0;
+    if(box_multi && (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+        return 0;
+    for(i = 0; i < nbox; i++){
+        if(strcmp(box[i].name, name) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int box_add(const char *name, const char *db_path){
+    box_t *b;
+
+    if(nbox == BOXES_MAX || !box_name_ok(name)){
+        fprintf(stderr, "cannot mount box:%s\n", name);
+        return -1;
+    }
+    b = &box[nbox];
+    if(sqlite3_open(db_path, &b->db) != SQLITE_OK){
+        fprintf(stderr, "cannot open database:%s\n", sqlite3_errmsg(b->db));
+        sqlite3_close(b->db);
+        return -1;
+    }
+    strcpy(b->name, name);
+    pthread_mutex_init(&b->asof_lock, NULL);
+    nbox++;
+    return 0;
+}
+
+//every box in kvs.db, box <id> being fs<id>.db next to it
+static int box_add_kvs(const char *kvs_path){
+    int rc, res = 0, len, id;
+    char *sql;
+    const char *tail;
+    const char *p;
+    const char *name;
+    char db_path[512];
+    char name_id[64];
+    sqlite3 *kvs;
+    sqlite3_stmt *stmt;
+
+    if(sqlite3_open(kvs_path, &kvs) != SQLITE_OK){
+        fprintf(stderr, "cannot open database:%s\n", sqlite3_errmsg(kvs));
+        sqlite3_close(kvs);
+        return -1;
+    }
+    p = strrchr(kvs_path, '/');
+    len = p ? p - kvs_path + 1 : 0;
+
+    sql = "SELECT id, name FROM boxinfo ORDER BY id";
+    rc = sqlite3_prepare(kvs, sql, (int)strlen(sql), &stmt, &tail);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "SQL error:%s\n", sqlite3_errmsg(kvs));
+        sqlite3_close(kvs);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    while(rc == SQLITE_ROW && res == 0){
+        id = sqlite3_column_int(stmt, 0);
+        if((name = (const char*)sqlite3_column_text(stmt, 1)) == NULL)
+            name = "";
+        snprintf(db_path, sizeof(db_path), "%.*sfs%d.db", len, kvs_path, id);
+        //boxinfo.name is not unique: a clash is told apart by the box id
+        if(!box_name_ok(name)){
+            if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                    strchr(name, '/') != NULL)
+                snprintf(name_id, sizeof(name_id), "box%d", id);
+            else
+                snprintf(name_id, sizeof(name_id), "%.40s-%d", name, id);
+            fprintf(stderr, "box %s (id %d) is mounted as %s\n", name, id, name_id);
+            name = name_id;
+        }
+        if(access(db_path, R_OK) != 0)
+            fprintf(stderr, "box %s has no %s, skipped\n", name, db_path);
+        else
+            res = box_add(name, db_path);
+        rc = sqlite3_step(stmt);
     }
-        
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(kvs);
     return res;
 }
 
+static void *lunafuse_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+
+    //started here rather than in main, fuse_main forks into the background
+    if(trace_path[0] != '\0')
+        trace_begin();
+    if(write_enabled)
+        write_begin();
+    return NULL;
+}
+
+static void lunafuse_destroy(void *private_data)
+{
+    (void) private_data;
+
+    if(trace_file != NULL)
+        trace_end();
+    if(write_enabled)
+        write_end();
+    if(verify_failures > 0)
+        fprintf(stderr, "verify: %llu chunks did not match their sha1\n",
+                (unsigned long long)verify_failures);
+}
 
 static struct fuse_operations lunafuse_oper = {
-	.getattr	= lunafuse_getattr,
-	.readdir	= lunafuse_readdir,
-	.open		= lunafuse_open,
-	.read		= lunafuse_read,
+	.getattr	= box_getattr,
+	.readdir	= box_readdir,
+	.open		= box_open,
+	.read		= box_read,
+	.getxattr	= box_getxattr,
+	.listxattr	= box_listxattr,
+	.create		= box_create,
+	.write		= box_write,
+	.truncate	= box_truncate,
+	.ftruncate	= box_ftruncate,
+	.flush		= box_flush,
+	.release	= box_release,
+	.fsync		= box_fsync,
+	.mkdir		= box_mkdir,
+	.unlink		= box_unlink,
+	.rmdir		= box_rmdir,
+	.rename		= box_rename,
+	.utimens	= box_utimens,
+	.init		= lunafuse_init,
+	.destroy	= lunafuse_destroy,
 };
 
+/*
+ * replay a trace in-process, in timestamp order, against the db and data
+ * given with -m/-k. with -o replay_fast calls are issued back to back,
+ * otherwise the recorded spacing between them is kept. a replayed open
+ * keeps its handle until the matching release, so reads go through the
+ * index built at open as they do on a mount.
+ */
+typedef struct replay_op_t {
+    trace_rec_t  rec;
+    char        *path;
+} replay_op_t;
+
+typedef struct replay_fh_t {
+    uint32_t               tid;
+    const char            *path;
+    struct fuse_file_info  fi;
+} replay_fh_t;
+
+static int replay_fast = 0;
+
+static int replay_cmp(const void *a, const void *b){
+    const replay_op_t *x = (const replay_op_t*)a;
+    const replay_op_t *y = (const replay_op_t*)b;
+
+    if(x->rec.ts != y->rec.ts)
+        return x->rec.ts < y->rec.ts ? -1 : 1;
+    return 0;
+}
+
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off){
+    (void) buf;
+    (void) name;
+    (void) stbuf;
+    (void) off;
+    return 0;
+}
+
+//the thread's latest handle on the path, else any on it: fuse workers
+//do not keep a file to the thread that opened it
+static int replay_fh_find(const replay_fh_t *fh, int nfh, const replay_op_t *op){
+    int i, any = -1;
+
+    for(i = nfh - 1; i >= 0; i--){
+        if(strcmp(fh[i].path, op->path) != 0)
+            continue;
+        if(fh[i].tid == op->rec.tid)
+            return i;
+        if(any < 0)
+            any = i;
+    }
+    return any;
+}
+
+static int replay(const char *path){
+    static const char *op_name[] = {"", "getattr", "readdir", "open", "read", "release"};
+    int i, j, n = 0, cap = 0, nfh = 0, fh_cap = 0, has_release = 0;
+    uint64_t t, now, begin, count[6] = {0}, busy[6] = {0};
+    char magic[8];
+    char *buf = NULL;
+    size_t buf_size = 0;
+    struct stat st;
+    struct fuse_file_info fi;
+    struct timespec ts;
+    trace_rec_t rec;
+    replay_op_t *ops = NULL;
+    replay_fh_t *fh = NULL;
+    FILE *fp;
+
+    if((fp = fopen(path, "rb")) == NULL ||
+            fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0){
+        fprintf(stderr, "not a lunafuse trace:%s\n", path);
+        if(fp != NULL)
+            fclose(fp);
+        return -1;
+    }
+    while(fread(&rec, sizeof(rec), 1, fp) == 1){
+        if(n == cap){
+            cap = cap ? cap * 2 : 1024;
+            ops = (replay_op_t*)realloc(ops, cap * sizeof(replay_op_t));
+        }
+        ops[n].rec = rec;
+        ops[n].path = (char*)malloc(rec.path_len + 1);
+        if(fread(ops[n].path, 1, rec.path_len, fp) != rec.path_len){
+            free(ops[n].path);
+            break;
+        }
+        ops[n].path[rec.path_len] = '\0';
+        if(rec.op == TRACE_RELEASE)
+            has_release = 1;
+        n++;
+    }
+    fclose(fp);
+    //rings are drained one after another, so the file is only ordered per thread
+    qsort(ops, n, sizeof(replay_op_t), replay_cmp);
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    begin = trace_now();
+    for(i = 0; i < n; i++){
+        if(!replay_fast && ops[i].rec.ts > (now = trace_now() - begin)){
+            t = ops[i].rec.ts - now;
+            ts.tv_sec = t / 1000000000ULL;
+            ts.tv_nsec = t % 1000000000ULL;
+            nanosleep(&ts, NULL);
+        }
+        j = -1;
+        if(ops[i].rec.op == TRACE_READ || ops[i].rec.op == TRACE_RELEASE ||
+                (ops[i].rec.op == TRACE_OPEN && !has_release))
+            j = replay_fh_find(fh, nfh, &ops[i]);
+        //a trace without releases keeps one handle per thread and path
+        if(ops[i].rec.op == TRACE_OPEN && j >= 0 && fh[j].tid == ops[i].rec.tid){
+            lunafuse_oper.release(fh[j].path, &fh[j].fi);
+            fh[j] = fh[--nfh];
+        }
+        t = trace_now();
+        switch(ops[i].rec.op){
+        case TRACE_GETATTR:
+            lunafuse_oper.getattr(ops[i].path, &st);
+            break;
+        case TRACE_READDIR:
+            lunafuse_oper.readdir(ops[i].path, NULL, replay_filler, 0, NULL);
+            break;
+        case TRACE_OPEN:
+            memset(&fi, 0, sizeof(fi));
+            fi.flags = O_RDONLY;
+            if(lunafuse_oper.open(ops[i].path, &fi) != 0)
+                break;
+            if(nfh == fh_cap){
+                fh_cap = fh_cap ? fh_cap * 2 : 64;
+                fh = (replay_fh_t*)realloc(fh, fh_cap * sizeof(replay_fh_t));
+            }
+            fh[nfh].tid = ops[i].rec.tid;
+            fh[nfh].path = ops[i].path;
+            fh[nfh].fi = fi;
+            nfh++;
+            break;
+        case TRACE_READ:
+            if(ops[i].rec.size > buf_size){
+                buf_size = ops[i].rec.size;
+                buf = (char*)realloc(buf, buf_size);
+            }
+            if(j >= 0){
+                lunafuse_oper.read(ops[i].path, buf, ops[i].rec.size, ops[i].rec.offset, &fh[j].fi);
+                break;
+            }
+            //opened before the trace started
+            memset(&fi, 0, sizeof(fi));
+            fi.flags = O_RDONLY;
+            lunafuse_oper.read(ops[i].path, buf, ops[i].rec.size, ops[i].rec.offset, &fi);
+            break;
+        case TRACE_RELEASE:
+            if(j < 0)
+                continue;
+            lunafuse_oper.release(fh[j].path, &fh[j].fi);
+            fh[j] = fh[--nfh];
+            break;
+        default:
+            continue;
+        }
+        count[ops[i].rec.op]++;
+        busy[ops[i].rec.op] += trace_now() - t;
+    }
+    now = trace_now() - begin;
+    //handles still open when the trace ended
+    for(j = 0; j < nfh; j++)
+        lunafuse_oper.release(fh[j].path, &fh[j].fi);
+
+    printf("replayed %d calls in %.3f s\n", n, now / 1e9);
+    for(i = 1; i < 6; i++){
+        if(count[i] > 0)
+            printf("    %-8s %10llu calls %12.1f us/call\n", op_name[i],
+                    (unsigned long long)count[i], busy[i] / 1e3 / count[i]);
+    }
+    for(i = 0; i < n; i++)
+        free(ops[i].path);
+    free(ops);
+    free(fh);
+    free(buf);
+    return 0;
+}
+
+//lunafuse's own -o options, comma separated
+static int parse_opt(char *opts){
+    char *opt;
+    char cwd[512];
+
+    for(opt = strtok(opts, ","); opt != NULL; opt = strtok(NULL, ",")){
+        if(strcmp(opt, "mmap_chunks") == 0){
+            mmap_chunks = 1;
+        }
+        else if(strcmp(opt, "uring") == 0){
+            use_uring = 1;
+        }
+        else if(strncmp(opt, "trace=", 6) == 0 && opt[6] != '\0'){
+            //the mount runs from '/' once daemonized
+            cwd[0] = '\0';
+            if(opt[6] != '/' && getcwd(cwd, sizeof(cwd) - 1) != NULL)
+                strcat(cwd, "/");
+            if(snprintf(trace_path, sizeof(trace_path), "%s%s", cwd, opt + 6) >=
+                    (int)sizeof(trace_path)){
+                fprintf(stderr, "trace path too long:%s\n", opt + 6);
+                trace_path[0] = '\0';
+                return -1;
+            }
+        }
+        else if(strcmp(opt, "verify=first") == 0){
+            verify_mode = VERIFY_FIRST;
+        }
+        else if(strcmp(opt, "verify=always") == 0){
+            verify_mode = VERIFY_ALWAYS;
+        }
+        else if(strcmp(opt, "replay_fast") == 0){
+            replay_fast = 1;
+        }
+        else if(strcmp(opt, "rw") == 0){
+            write_enabled = 1;
+        }
+        else return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    char db_path[512];
+    char db_path[512] = "";
+    char replay_path[512] = "";
+    char *p;
     int i = 1;
     int count = 0;
     getcwd(data_path, sizeof(data_path));
@@ -830,28 +4088,68 @@ int main(int argc, char *argv[])
                 strcat(data_path, argv[i+1]);
                 strcat(data_path, "/");
             }
+
+            else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+                count++;
+                box_multi = 1;
+                if((p = strchr(argv[i+1], '=')) != NULL){
+                    *p = '\0';
+                    if(box_add(argv[i+1], p + 1) != 0)
+                        return -1;
+                }
+                else if(box_add_kvs(argv[i+1]) != 0){
+                    return -1;
+                }
+            }
+
+            else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+                count++;
+                strcpy(replay_path, argv[i+1]);
+            }
+
+            else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+                count++;
+                if(parse_opt(argv[i+1]) != 0){
+                    printf("unknown option:%s\n", argv[i+1]);
+                    return -1;
+                }
+            }
         i++;
     } 
 
-    int rc;
-    rc = sqlite3_open(db_path, &db);
-    if(rc){
-        fprintf(stderr, "cannot open database:%s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+    int rc = 0;
+    sha1_init();
+    if(box_multi == (db_path[0] != '\0')){
+        printf("command not found!\n");
+        return -1;
+    }
+    if(!box_multi && box_add("", db_path) != 0){
         return -1;
     }
+    for(i = 0; i < nbox && write_enabled; i++){
+        if(write_setup(&box[i]) != 0)
+            return -1;
+    }
+
+    if(replay_path[0] != '\0'){
+        if((count*2 + 1) == argc){
+            rc = replay(replay_path);
+        }else{
+            printf("command not found!\n");
+            rc = -1;
+        }
+    }
 
-    if((count*2 + 2) == argc){
-        strcpy(argv[1], argv[argc-1]);
+    else if((count*2 + 2) == argc){
+        argv[1] = argv[argc-1];
         argc = 2;
+        fuse_main(argc, argv, &lunafuse_oper, NULL);
     }else{
         printf("command not found!\n");
-        return -1;
+        rc = -1;
     }
-  
-    fuse_main(argc, argv, &lunafuse_oper, NULL);
     
-    sqlite3_close(db);
-    return 0;
+    for(i = 0; i < nbox; i++)
+        sqlite3_close(box[i].db);
+    return rc;
 }
-